@@ -182,13 +182,52 @@ void HardFaultISR(void)
     while (1);
 }
 
+// Fault address or, when the frame could not be pushed, the PSP itself is
+// inside the guard subregion at the bottom of the task's stack, or in the
+// block below a stack that has grown
+static bool isStackOverflow(uint32_t cfsr, uint32_t psp)
+{
+    uint32_t base = (uint32_t)tcb[taskCurrent].stackBase;
+    uint32_t extra = tcb[taskCurrent].stackExtra;
+    uint32_t guardBottom = extra != 0 ? base - extra - BLOCK_SIZE : base;
+    uint32_t guardTop = extra != 0 ? base - extra : base + STACK_GUARD(tcb[taskCurrent].stackSize);
+
+    if (base == 0)
+        return false;
+    if ((cfsr & (1 << 7)) && NVIC_MM_ADDR_R >= guardBottom && NVIC_MM_ADDR_R < guardTop)
+        return true;
+    return (cfsr & (1 << 4)) && psp < guardTop;
+}
+
 void MPUFaultISR(void)
 {
+    uint32_t cfsr = NVIC_FAULT_STAT_R;
+
+    // A growable stack takes the free blocks below it and the faulting
+    // instruction is retried
+    if ((cfsr & (1 << 7)) && (cfsr & (1 << 1)) && growStack(NVIC_MM_ADDR_R))
+    {
+        NVIC_FAULT_STAT_R = (cfsr & 0xFF);
+        return;
+    }
+
     putsUart0("\n=== MPU FAULT ISR ENTERED ===\n");
     setPinValue(GREEN_LED, 1);
     unsigned int pid = (unsigned int)tcb[taskCurrent].pid;
     StackFrame *stack = (StackFrame *)getPsp();
-    uint32_t cfsr = NVIC_FAULT_STAT_R;
+
+    // The task cannot go on without a stack, report and kill it
+    if (isStackOverflow(cfsr, (uint32_t)stack))
+    {
+        putsUart0("stack overflow in ");
+        putsUart0(tcb[taskCurrent].name);
+        putsUart0("\n");
+        printHex("SP:", (uint32_t)stack);
+
+        NVIC_FAULT_STAT_R = (cfsr & 0xFF);
+        killTask(taskCurrent);
+        return;
+    }
 
     putsUart0("MPU fault in process ");
     char str[12];
@@ -220,15 +259,25 @@ void MPUFaultISR(void)
 
 uint32_t *pendSvC(uint32_t *oldPsp)
 {
-    tcb[taskCurrent].sp = oldPsp;
+    // SysTick may not touch the task table while switching
+    uint32_t basepri = enterCritical();
+
+    // A task that restarted itself keeps the fresh stack top
+    if (tcb[taskCurrent].state != STATE_UNRUN)
+        tcb[taskCurrent].sp = oldPsp;
+    reclaimKilledTasks();
 
     uint8_t next = rtosScheduler();
     if (tcb[next].pid == 0 || tcb[next].state == STATE_INVALID)
         while (1);    // no valid task
 
     taskCurrent = next;
+    IPC_SHARED->current = next + 1;
 
     applySramAccessMask((uint32_t)tcb[next].srd);
+    setupStackRegion((uint32_t)tcb[next].stackBase, tcb[next].stackSize,
+                     tcb[next].stackExtra == 0);
+    applyTopicAccessMask(tcb[next].topicSamples);
 
     if (tcb[next].state == STATE_UNRUN)
     {
@@ -257,5 +306,13 @@ uint32_t *pendSvC(uint32_t *oldPsp)
 
         tcb[next].sp = psp;
     }
+    else if (tcb[next].resultPending)
+    {
+        // Return value of the call that blocked, R0 sits above R4-R11
+        ((uint32_t *)tcb[next].sp)[8] = (uint32_t)tcb[next].waitResult;
+        tcb[next].resultPending = false;
+    }
+
+    leaveCritical(basepri);
     return (uint32_t *)tcb[next].sp;
 }
@@ -31,6 +31,7 @@ extern void setAsp(void);
 extern void putsUart0(const char *);
 extern void putcUart0(char c);
 extern void itoa(int num, char *str, int base);
+extern void printHex(const char *label, unsigned int val);
 extern void switchToUnpriv(void);
 
 // task states
@@ -41,10 +42,31 @@ extern void switchToUnpriv(void);
 #define STATE_BLOCKED_SEMAPHORE 4 // has run, but now blocked by semaphore
 #define STATE_BLOCKED_MUTEX     5 // has run, but now blocked by mutex
 #define STATE_KILLED            6 // task has been killed
+#define STATE_BLOCKED_FUTEX     7 // has run, but now blocked on a futex word
+#define STATE_BLOCKED_QUEUE     8 // has run, but now blocked on a message queue
+#define STATE_BLOCKED_NOTIFY    9 // has run, but now awaiting a notification
+#define STATE_BLOCKED_RWLOCK    10 // has run, but now blocked on a reader-writer lock
+#define STATE_BLOCKED_COND      11 // has run, but now waiting on a condition variable
+#define STATE_BLOCKED_POLL      12 // has run, but now waiting for one of several objects
+#define STATE_BLOCKED_FLAGS     13 // has run, but now waiting on an event flag group
+#define STATE_SEND_BLOCKED      14 // has run, but now waiting for a server to receive
+#define STATE_REPLY_BLOCKED     15 // has run, but now waiting for a server to reply
+#define STATE_RECEIVE_BLOCKED   16 // has run, but now waiting for a client to send
+#define STATE_BLOCKED_PIPE      17 // has run, but now waiting to read or write a pipe
+#define STATE_BLOCKED_TOPIC     18 // has run, but now waiting for a topic sample
+#define STATE_BLOCKED_BARRIER   19 // has run, but now waiting at a barrier
 
 struct _tcb tcb[MAX_TASKS];
-mutex mutexes[MAX_MUTEXES];
-semaphore semaphores[MAX_SEMAPHORES];
+kobject objects[MAX_OBJECTS];
+
+// Topic sample pool, a sample is free when nothing references it
+static uint8_t *topicPool;
+static uint8_t sampleRefs[TOPIC_SAMPLES];
+static uint16_t sampleLength[TOPIC_SAMPLES];
+
+// One entry per object slot, heap allocated to keep kernel RAM small
+static lockStats *stats;
+waitQueue futexTable[FUTEX_BUCKETS];
 
 // task
 uint8_t taskCurrent = 0;          // index of last dispatched task
@@ -53,988 +75,4009 @@ uint8_t taskCount = 0;            // total number of valid tasks
 // control
 bool priorityScheduler = true;    // priority (true) or round-robin (false)
 bool priorityInheritance = false; // priority inheritance for mutexes
+uint8_t deadlockPolicy = DEADLOCK_REPORT;
+bool lockStatsAll = false;        // route every lock/unlock/wait/post through the kernel
 bool preemption = true;          // preemption (true) or cooperative (false)
 
+// stack high-water marks, the idle task scans a few words per call
+#define STACK_PAINT      0xC0DEC0DE
+#define STACK_SCAN_WORDS 32
+extern uint32_t __stack;            // MSP stack from the linker command file
+extern uint32_t __STACK_TOP;
+static uint8_t scanTask = 0;
+static uint32_t scanOffset = 0;
+
+// heap
+static uint16_t reclaimPending = 0; // tasks that killed themselves, freed on the next switch
+static uint32_t heapReclaimed = 0;  // bytes returned by kill and restart since boot
+
 // tcb
 #define NUM_PRIORITIES   8
 
+// data watchpoint and trace cycle counter
+#define DWT_CTRL_R       (*((volatile uint32_t *)0xE0001000))
+#define DWT_CYCCNT_R     (*((volatile uint32_t *)0xE0001004))
+#define DWT_CTRL_CYCCNTENA 0x00000001
+#define DEMCR_TRCENA     0x01000000
+
 static uint8_t priorityIndex[NUM_PRIORITIES] = {0};
 
 //-----------------------------------------------------------------------------
 // Subroutines
 //-----------------------------------------------------------------------------
 
-bool initMutex(uint8_t m)
+// Owner of a mutex slot as a task index, 0xFF if free
+// Tasks can write the word, so an owner that is not a task index is 0xFF too
+static uint8_t mutexOwner(uint8_t slot)
 {
-    bool ok = (m < MAX_MUTEXES);
-    if (ok)
-    {
-        mutexes[m].lock      = false;
-        mutexes[m].lockedBy  = 0;
-        mutexes[m].queueSize = 0;
-        // clear queue entries
-        uint8_t i;
-        for (i = 0; i < MAX_MUTEX_QUEUE_SIZE; i++)
-            mutexes[m].processQueue[i] = 0;
-    }
-    return ok;
+    uint32_t owner = IPC_SHARED->word[slot] & MUTEX_OWNER_M;
+    return owner != 0 && owner - 1 < MAX_TASKS ? (uint8_t)(owner - 1) : 0xFF;
 }
 
-bool initSemaphore(uint8_t semaphore, uint8_t count)
+// False if the word names an owner that is not a live task, which only a
+// task writing the word can cause
+static bool mutexOwnerValid(uint8_t slot)
 {
-    bool ok = (semaphore < MAX_SEMAPHORES);
-    if (ok)
-    {
-        semaphores[semaphore].count     = count;
-        semaphores[semaphore].queueSize = 0;
-        // clear queue entries
-        uint8_t i;
-        for (i = 0; i < MAX_SEMAPHORE_QUEUE_SIZE; i++)
-            semaphores[semaphore].processQueue[i] = 0;
-    }
-    return ok;
+    uint8_t owner = mutexOwner(slot);
+
+    if ((IPC_SHARED->word[slot] & MUTEX_OWNER_M) == 0)
+        return true;
+    return owner < MAX_TASKS && tcb[owner].state != STATE_INVALID && tcb[owner].state != STATE_KILLED;
 }
 
-unsigned int stringLen(const char *s)
+// The stack has its own MPU region, the SRD windows start with the shared
+// IPC block only
+static uint32_t createTaskSramMask(void)
 {
-    unsigned int len = 0;
-    while (s[len] != '\0')
-        len++;
-    return len;
+    uint32_t mask = createNoSramAccessMask();
+    addSramAccessWindow(&mask, (uint32_t)IPC_SHARED, BLOCK_SIZE);
+    return mask;
 }
 
-// REQUIRED: initialize systick for 1ms system timer
-void initRtos(void)
+void initWaitQueue(waitQueue *q)
 {
-    uint8_t i;
-    // Initialize ALL TCB entries to INVALID
-    for (i = 0; i < MAX_TASKS; i++)
+    q->head = NO_TASK;
+}
+
+// Blocks the current task on q behind every waiter of equal or better priority
+// timeout is in ticks, WAIT_FOREVER never expires
+static void insertWaiter(waitQueue *q, uint8_t task)
+{
+    uint8_t *link = &q->head;
+
+    while (*link != NO_TASK && tcb[*link].currentPriority <= tcb[task].currentPriority)
+        link = &tcb[*link].nextWaiter;
+    tcb[task].nextWaiter = *link;
+    *link = task;
+
+    tcb[task].blockedOn = q;
+}
+
+static void blockOn(waitQueue *q, uint8_t state, uint32_t timeout)
+{
+    insertWaiter(q, taskCurrent);
+    tcb[taskCurrent].state = state;
+    tcb[taskCurrent].ticks = timeout;
+
+    NVIC_INT_CTRL_R |= (1 << 28);
+}
+
+static void unlinkWaiter(uint8_t task)
+{
+    uint8_t *link = &tcb[task].blockedOn->head;
+
+    while (*link != NO_TASK && *link != task)
+        link = &tcb[*link].nextWaiter;
+    if (*link == task)
+        *link = tcb[task].nextWaiter;
+
+    tcb[task].blockedOn  = 0;
+    tcb[task].nextWaiter = NO_TASK;
+}
+
+// Changes the effective priority, keeping any wait queue it sits on ordered
+static void setCurrentPriority(uint8_t task, uint8_t priority)
+{
+    tcb[task].currentPriority = priority;
+    if (tcb[task].blockedOn != 0)
     {
-        tcb[i].state = STATE_INVALID;
-        tcb[i].pid = 0;
-        tcb[i].sp = 0;
+        waitQueue *q = tcb[task].blockedOn;
+        unlinkWaiter(task);
+        insertWaiter(q, task);
     }
-    taskCount = 0;
-    taskCurrent = 0xFF; // No current task
+}
 
-    NVIC_ST_CTRL_R = 0;
-    NVIC_ST_RELOAD_R = 40000 - 1;
-    NVIC_ST_CURRENT_R = 0;
-    NVIC_ST_CTRL_R = NVIC_ST_CTRL_CLK_SRC
-                   | NVIC_ST_CTRL_INTEN
-                   | NVIC_ST_CTRL_ENABLE;
+// Readies a blocked task, result is returned from its blocking call
+static void wakeTask(uint8_t task, int32_t result)
+{
+    if (tcb[task].blockedOn != 0)
+        unlinkWaiter(task);
+
+    tcb[task].ticks         = 0;
+    tcb[task].state         = STATE_READY;
+    tcb[task].waitResult    = result;
+    tcb[task].resultPending = true;
 }
 
-// REQUIRED: Implement prioritization to NUM_PRIORITIES
-uint8_t rtosScheduler(void)
+static uint8_t futexHash(uint32_t addr)
 {
-    //  Round Robin scheduler
-    if (!priorityScheduler)
-    {
-        static uint8_t task = 0xFF;
-        uint8_t count = 0;
+    return ((addr >> 2) ^ (addr >> 7)) & (FUTEX_BUCKETS - 1);
+}
 
-        while (count < MAX_TASKS)
-        {
-            task++;
-            if (task >= MAX_TASKS)
-                task = 0;
+static void wakeAll(waitQueue *q, int32_t result)
+{
+    while (q->head != NO_TASK)
+        wakeTask(q->head, result);
+}
 
-            if ((tcb[task].state == STATE_READY || tcb[task].state == STATE_UNRUN) &&
-                tcb[task].state != STATE_INVALID &&
-                tcb[task].state != STATE_KILLED &&
-                tcb[task].pid != 0)
-            {
-                return task;
-            }
+// Slot of a live object of the given type, MAX_OBJECTS if the handle is stale
+static uint8_t objectSlot(handle h, uint8_t type)
+{
+    uint8_t slot = HANDLE_SLOT(h);
+    if (slot >= MAX_OBJECTS || objects[slot].type != type ||
+        objects[slot].generation != HANDLE_GENERATION(h))
+        return MAX_OBJECTS;
+    return slot;
+}
 
-            count++;
-        }
-        putsUart0("No READY tasks (RR)!\n");
-        while (1);
-    }
+// Lowest usable stack address: below the guard, or the last block claimed
+// by growStack once the guard has been opened
+static uint32_t stackLimit(uint8_t task)
+{
+    uint32_t base = (uint32_t)tcb[task].stackBase;
 
-    //  Priority based scheduler
-    uint8_t bestPriority = NUM_PRIORITIES;
-    uint8_t nextTask = 0xFF;
-    uint8_t i, j;
+    if (tcb[task].stackExtra != 0)
+        return base - tcb[task].stackExtra;
+    return base + STACK_GUARD(tcb[task].stackSize);
+}
 
-    // Find best priority among READY/UNRUN tasks
-    for (i = 0; i < MAX_TASKS; i++)
+static bool isInTaskStack(uint8_t task, uint32_t addr, uint32_t size)
+{
+    uint32_t base = (uint32_t)tcb[task].stackBase;
+    return base != 0 && addr >= stackLimit(task) && addr + size > addr &&
+           addr + size <= base + tcb[task].stackSize;
+}
+
+// Whole stack allocation, guard and grown blocks included
+static bool isInStackAllocation(uint8_t task, uint32_t addr)
+{
+    uint32_t base = (uint32_t)tcb[task].stackBase;
+    return base != 0 && addr >= base - tcb[task].stackExtra &&
+           addr < base + tcb[task].stackSize;
+}
+
+// Blocks of the stack region and of any growth below it
+static uint32_t taskStackBlocks(uint8_t task)
+{
+    uint32_t base = (uint32_t)tcb[task].stackBase;
+    uint32_t blocks = (tcb[task].stackSize + tcb[task].stackExtra) / BLOCK_SIZE;
+
+    if (base == 0)
+        return 0;
+    return ((1U << blocks) - 1) <<
+           ((base - tcb[task].stackExtra - (uint32_t)HEAP_BASE) / BLOCK_SIZE);
+}
+
+// Heap blocks the task owns outside its stack
+static uint32_t taskHeapBlocks(uint8_t task)
+{
+    return heapBlocksOwned((uint16_t)(task + 1)) & ~taskStackBlocks(task);
+}
+
+static uint8_t countBlocks(uint32_t blocks)
+{
+    uint8_t count = 0;
+
+    while (blocks != 0)
     {
-        if ((tcb[i].state == STATE_READY || tcb[i].state == STATE_UNRUN) &&
-            tcb[i].state != STATE_INVALID &&
-            tcb[i].state != STATE_KILLED &&
-            tcb[i].pid != 0)
-        {
-            if (tcb[i].currentPriority < bestPriority)
-                bestPriority = tcb[i].currentPriority;
-        }
+        blocks &= blocks - 1;
+        count++;
     }
+    return count;
+}
 
-    if (bestPriority == NUM_PRIORITIES)
+static uint8_t taskHeapBlockCount(uint8_t task)
+{
+    return countBlocks(taskHeapBlocks(task));
+}
+
+// IPC block plus a window for every heap block from taskMalloc and every
+// block the stack has grown into
+static void updateTaskSramMask(uint8_t task)
+{
+    uint32_t mask = createTaskSramMask();
+    uint32_t i;
+
+    if (tcb[task].stackExtra != 0)
+        addSramAccessWindow(&mask, (uint32_t)tcb[task].stackBase - tcb[task].stackExtra,
+                            tcb[task].stackExtra);
+
+    uint32_t owned = taskHeapBlocks(task);
+    for (i = 0; i < MAX_BLOCKS; i++)
     {
-        putsUart0("No READY tasks!\n");
-        while (1);
+        if (owned & (1U << i))
+            addSramAccessWindow(&mask, (uint32_t)HEAP_BASE + i * BLOCK_SIZE, BLOCK_SIZE);
     }
+    tcb[task].srd = mask;
+}
 
-    // Round robin within priority, starting after current task
-    uint8_t start = priorityIndex[bestPriority];
+// Slabs and taskMalloc blocks of a killed or restarting task, and the
+// stack unless a restart reuses it
+static uint32_t reclaimTaskMemory(uint8_t task, bool keepStack)
+{
+    uint32_t bytes = free_heap_pid((uint16_t)(task + 1), keepStack ? tcb[task].stackBase : 0);
+
+    if (!keepStack)
+        tcb[task].stackBase = 0;
+    tcb[task].stackExtra = 0;
+    reclaimPending &= ~(1U << task);
+    heapReclaimed += bytes;
+    return bytes;
+}
 
-    for (j = 0; j < MAX_TASKS; j++)
-    {
-        uint8_t i = (start + j) % MAX_TASKS;
+// A task that killed itself was still running on its stack, PendSV frees it
+// once the task has been switched out
+void reclaimKilledTasks(void)
+{
+    uint8_t task;
 
-        // Skip current task AND check if ready
-        if (i != taskCurrent &&
-            (tcb[i].state == STATE_READY || tcb[i].state == STATE_UNRUN) &&
-            tcb[i].state != STATE_INVALID &&
-            tcb[i].state != STATE_KILLED &&
-            tcb[i].pid != 0 &&
-            tcb[i].currentPriority == bestPriority)
-        {
-            nextTask = i;
-            priorityIndex[bestPriority] = (i + 1) % MAX_TASKS;
-            break;
-        }
+    for (task = 0; task < MAX_TASKS && reclaimPending != 0; task++)
+    {
+        if ((reclaimPending & (1U << task)) && task != taskCurrent)
+            reclaimTaskMemory(task, false);
     }
+}
 
-    // Didn't find a different task, keep current
-    if (nextTask == 0xFF)
+static void paintStack(uint8_t task)
+{
+    uint32_t *word = (uint32_t *)tcb[task].stackBase;
+    uint32_t count = tcb[task].stackSize / sizeof(uint32_t);
+
+    while (count-- > 0)
+        *word++ = STACK_PAINT;
+    tcb[task].stackUnused = tcb[task].stackSize;
+    if (scanTask == task)
+        scanOffset = 0;
+}
+
+// Bytes from base up to the first word that is no longer painted
+static uint32_t paintedBytes(const uint32_t *base, uint32_t limit)
+{
+    uint32_t offset = 0;
+
+    while (offset < limit && base[offset / sizeof(uint32_t)] == STACK_PAINT)
+        offset += sizeof(uint32_t);
+    return offset;
+}
+
+// Walks up from each stack bottom in turn, at most budget words per call,
+// and lowers stackUnused at the first word a task has written
+static void scanStackWords(uint32_t budget)
+{
+    while (budget-- > 0)
     {
-        if (tcb[taskCurrent].state == STATE_READY || tcb[taskCurrent].state == STATE_UNRUN)
-            nextTask = taskCurrent;
-        else
+        struct _tcb *t = &tcb[scanTask];
+        const uint32_t *base = (const uint32_t *)t->stackBase;
+
+        if (base != 0)
+            base = (const uint32_t *)((uint32_t)base - t->stackExtra);
+
+        if (t->state == STATE_INVALID || base == 0 || scanOffset >= t->stackUnused ||
+            base[scanOffset / sizeof(uint32_t)] != STACK_PAINT)
         {
-            putsUart0("No valid task found!\n");
-            while (1);
+            if (base != 0 && scanOffset < t->stackUnused)
+                t->stackUnused = scanOffset;
+            scanOffset = 0;
+            scanTask = (scanTask + 1) % MAX_TASKS;
         }
+        else
+            scanOffset += sizeof(uint32_t);
     }
-
-    return nextTask;
 }
 
-// REQUIRED: modify this function to start the operating system
-// by calling scheduler, set srd bits, setting PSP, ASP bit, call fn with fn add in R0
-// fn set TMPL bit, and PC <= fn
-void startRtos(void)
+// Caller may read the range, flash, its stack or one of its SRD windows
+// An empty range touches nothing so any pointer is accepted
+static bool isReadableByTask(uint8_t task, uint32_t addr, uint32_t size)
 {
-    taskCurrent = rtosScheduler();
+    if (size == 0 || (addr + size <= 0x00040000 && addr + size > addr))
+        return true;
+    return isInTaskStack(task, addr, size) ||
+           isSramAccessAllowed((uint32_t)tcb[task].srd, addr, size);
+}
 
-    tcb[taskCurrent].state = STATE_READY;
+static bool isWritableByTask(uint8_t task, uint32_t addr, uint32_t size)
+{
+    return size == 0 || isInTaskStack(task, addr, size) ||
+           isSramAccessAllowed((uint32_t)tcb[task].srd, addr, size);
+}
 
-    disableMpu();
-    applySramAccessMask(tcb[taskCurrent].srd);
-    enableMpu();
+static bool namesMatch(const char a[], const char b[])
+{
+    uint8_t i = 0;
+    while (i < OBJECT_NAME_SIZE - 1 && a[i] != '\0' && a[i] == b[i])
+        i++;
+    return i == OBJECT_NAME_SIZE - 1 || a[i] == b[i];
+}
 
-    uint32_t sp = (uint32_t)tcb[taskCurrent].sp;
-    setPsp(sp);
+static void detachHeldMutex(uint8_t slot)
+{
+    uint8_t task = objects[slot].u.mtx.heldBy;
 
-    setAsp();
+    if (task != NO_TASK)
+    {
+        uint8_t *link = &tcb[task].heldMutexes;
 
-    _fn fn = (_fn)tcb[taskCurrent].pid;
+        while (*link != NO_OBJECT && *link != slot)
+            link = &objects[*link].u.mtx.nextHeld;
+        if (*link == slot)
+            *link = objects[slot].u.mtx.nextHeld;
+    }
 
-    switchToUnpriv();
+    objects[slot].u.mtx.nextHeld = NO_OBJECT;
+    objects[slot].u.mtx.heldBy = NO_TASK;
+    IPC_SHARED->word[slot] &= ~MUTEX_TRACKED;
+}
 
-    fn();
+// Held lists are LIFO so kill cleanup releases in reverse lock order
+static void attachHeldMutex(uint8_t task, uint8_t slot)
+{
+    detachHeldMutex(slot);
+    objects[slot].u.mtx.nextHeld = tcb[task].heldMutexes;
+    objects[slot].u.mtx.heldBy = task;
+    tcb[task].heldMutexes = slot;
+    IPC_SHARED->word[slot] |= MUTEX_TRACKED;
 }
 
-// REQUIRED:
-// add task if room in task list
-// store the thread name
-// allocate stack space and store top of stack in sp and spInit
-// set the srd bits based on the memory allocation
-bool createThread(_fn fn, const char name[], uint8_t priority, uint32_t stackBytes)
+// Base priority raised to the best waiter on any mutex the task holds and
+// to the best client sending to it or waiting for its reply
+// A change is passed on to the owner of the mutex the task waits for, so a
+// boost given through a chain is also taken back through it
+static void updateInheritedPriority(uint8_t task)
 {
-    bool ok = false;
-    uint8_t i = 0;
-    bool found = false;
-    if (taskCount < MAX_TASKS)
+    uint8_t hops = 0;
+    uint8_t slot, client;
+
+    while (task < MAX_TASKS && hops++ < MAX_TASKS)
     {
-        while (!found && (i < MAX_TASKS))
-        {
-            found = (tcb[i++].pid == fn);
-        }
-        if (!found)
+        uint8_t priority = tcb[task].priority;
+
+        if (priorityInheritance)
         {
-            //Find first available TCB entry
-            i = 0;
-            while (tcb[i].state != STATE_INVALID && i < MAX_TASKS)
-                i++;
-            if (i < MAX_TASKS)
+            for (slot = tcb[task].heldMutexes; slot != NO_OBJECT; slot = objects[slot].u.mtx.nextHeld)
             {
-                uint8_t *stackBase = (uint8_t *)malloc_heap(stackBytes, (uint16_t)(i + 1));
-                if (stackBase == 0)
-                    return false;   // allocation failed
-                uint8_t *stackTop = stackBase + stackBytes;
-                // 8 byte alignment
-                stackTop = (uint8_t *)(((uint32_t)stackTop) & 0xFFFFFFF8);
-                // TCB fields
-                tcb[i].state           = STATE_UNRUN;
-                tcb[i].pid             = fn;
-                tcb[i].priority        = priority;
-                tcb[i].currentPriority = priority;
-                tcb[i].ticks           = 0;
-                tcb[i].sp              = (void *)stackTop;   // PSP starts at top of stack
-                tcb[i].mutex           = 0xFF;
-                tcb[i].semaphore       = 0xFF;
-                tcb[i].stackBase       = stackBase;
-                tcb[i].stackSize       = stackBytes;
+                uint8_t waiter = objects[slot].u.mtx.waiters.head;
+                if (waiter != NO_TASK && tcb[waiter].currentPriority < priority)
+                    priority = tcb[waiter].currentPriority;
+            }
+        }
 
-                // Copy the thread name
-                uint8_t j = 0;
-                while (name[j] != '\0' && j < sizeof(tcb[i].name) - 1)
-                {
-                    tcb[i].name[j] = name[j];
-                    j++;
-                }
-                tcb[i].name[j] = '\0';
+        for (client = 0; client < MAX_TASKS; client++)
+        {
+            if ((tcb[client].state == STATE_SEND_BLOCKED || tcb[client].state == STATE_REPLY_BLOCKED) &&
+                tcb[client].msgServer == task && tcb[client].currentPriority < priority)
+                priority = tcb[client].currentPriority;
+        }
 
-                // MPU SRD mask for this stack region
-                tcb[i].srd = createSramAccessMaskForStack((uint32_t)stackBase, stackBytes);
+        if (priority == tcb[task].currentPriority)
+            break;
+        setCurrentPriority(task, priority);
 
-                taskCount++;
-                ok = true;
-            }
-        }
+        if (tcb[task].state == STATE_BLOCKED_MUTEX)
+            task = mutexOwner(tcb[task].waitingMutex);
+        else
+            task = NO_TASK;
     }
-    return ok;
 }
 
-// REQUIRED: modify this function to kill a thread
-// REQUIRED: free memory, remove any pending semaphore waiting,
-//           unlock any mutexes, mark state as killed
-//void killThread(_fn fn)
-//{
-//    Moved to psp_msp.s
-//}
+// Boosts the owner and anything the owner is itself waiting behind
+static void inheritPriority(uint8_t owner, uint8_t priority)
+{
+    uint8_t hops = 0;
 
-// REQUIRED: modify this function to restart a thread, including creating a stack
-//void restartThread(_fn fn)
-//{
-//    Moved to psp_msp.s
-//}
+    while (owner < MAX_TASKS && hops++ < MAX_TASKS && priority < tcb[owner].currentPriority)
+    {
+        setCurrentPriority(owner, priority);
+        if (tcb[owner].state == STATE_BLOCKED_MUTEX)
+            owner = mutexOwner(tcb[owner].waitingMutex);
+        else
+            owner = NO_TASK;
+    }
+}
 
-// REQUIRED: modify this function to set a thread priority
-//void setThreadPriority(_fn fn, uint8_t priority)
-//{
-//    Moved to psp_msp.s
-//}
+static void statBlocked(uint8_t slot, uint8_t task)
+{
+    stats[slot].contended++;
+    tcb[task].waitStart = DWT_CYCCNT_R;
+}
 
-// REQUIRED: modify this function to yield execution back to scheduler using pendsv
-void yield(void)
+// A mutex acquired here is always tracked so its unlock traps and ends the hold
+static void statAcquired(uint8_t slot)
 {
-    __asm("    SVC #0");
-    __asm("    BX LR");
+    stats[slot].acquisitions++;
+    if (objects[slot].type == OBJ_MUTEX)
+    {
+        stats[slot].holdStart = DWT_CYCCNT_R;
+        stats[slot].holdTimed = true;
+    }
 }
 
-// REQUIRED: modify this function to support 1ms system timer
-// execution yielded back to scheduler until time elapses using pendsv
-//void sleep(uint32_t tick)
-//{
-//    Moved to psp_msp.s
-//}
+static void statWaited(uint8_t slot, uint8_t task)
+{
+    uint32_t wait = DWT_CYCCNT_R - tcb[task].waitStart;
 
-// REQUIRED: modify this function to wait a semaphore using pendsv
-//void wait(int8_t semaphore)
-//{
-//    Moved to psp_msp.s
-//}
+    stats[slot].waitCycles += wait;
+    if (wait > stats[slot].maxWait)
+        stats[slot].maxWait = wait;
+    statAcquired(slot);
+}
 
-// REQUIRED: modify this function to signal a semaphore is available using pendsv
-//void post(int8_t semaphore)
-//{
-//    Moved to psp_msp.s
-//}
+static void statReleased(uint8_t slot)
+{
+    if (stats[slot].holdTimed)
+    {
+        uint32_t hold = DWT_CYCCNT_R - stats[slot].holdStart;
 
-// REQUIRED: modify this function to lock a mutex using pendsv
-__attribute__((naked)) void lock(int8_t mutex)
+        stats[slot].holds++;
+        stats[slot].holdCycles += hold;
+        if (hold > stats[slot].maxHold)
+            stats[slot].maxHold = hold;
+        stats[slot].holdTimed = false;
+    }
+}
+
+static void clearStats(uint8_t slot)
 {
-    __asm("  SVC #2");
-    __asm("  BX LR");
+    uint8_t *p = (uint8_t *)&stats[slot];
+    uint32_t i;
+
+    for (i = 0; i < sizeof(lockStats); i++)
+        p[i] = 0;
 }
 
-// REQUIRED: modify this function to unlock a mutex using pendsv
-__attribute__((naked)) void unlock(int8_t mutex)
+static void resetStats(void)
 {
-    __asm("  SVC #3");
-    __asm("  BX LR");
+    uint8_t slot;
+
+    for (slot = 0; slot < MAX_OBJECTS; slot++)
+        clearStats(slot);
 }
 
-// REQUIRED: modify this function to add support for the system timer
-// REQUIRED: in preemptive code, add code to request task switch
-void sysTickIsr(void)
+// Clearing the tag makes lock(), unlock(), wait() and post() trap every time
+static uint32_t fastPathTag(uint8_t slot)
 {
-    bool needSwitch = false;
+    handle h = ((handle)objects[slot].generation << 8) | slot;
 
-    // CPU time 1 tick = 1 ms of execution time
-    if (tcb[taskCurrent].state == STATE_READY)
+    if (lockStatsAll && (objects[slot].type == OBJ_MUTEX || objects[slot].type == OBJ_SEMAPHORE))
+        return 0;
+    return OBJECT_TAG(objects[slot].type, h);
+}
+
+// The wait-for graph has an edge from each task blocked on a mutex to its
+// owner, true if following edges from owner leads back to task
+static bool closesCycle(uint8_t task, uint8_t owner)
+{
+    uint8_t hops = 0;
+
+    while (owner < MAX_TASKS && hops++ < MAX_TASKS)
     {
-        // Accumulate runtime for the active task
-        tcb[taskCurrent].runTime++;
+        if (owner == task)
+            return true;
+        if (tcb[owner].state != STATE_BLOCKED_MUTEX)
+            return false;
+        owner = mutexOwner(tcb[owner].waitingMutex);
     }
+    return false;
+}
 
-    // Sleep delays
-    int i;
-    for (i = 0; i < MAX_TASKS; i++)
+// Prints task -> mutex -> owner ... around the cycle back to task
+static void printCycle(uint8_t task, uint8_t slot)
+{
+    uint8_t t = task;
+    uint8_t hops = 0;
+
+    putsUart0("deadlock: ");
+    putsUart0(tcb[t].name);
+    while (hops++ < MAX_TASKS)
     {
-        if (tcb[i].state == STATE_DELAYED)
+        putsUart0(" -> ");
+        putsUart0(objects[slot].name);
+        putsUart0(" -> ");
+        t = mutexOwner(slot);
+        if (t >= MAX_TASKS)
+            break;
+        putsUart0(tcb[t].name);
+        if (t == task || tcb[t].state != STATE_BLOCKED_MUTEX)
+            break;
+        slot = tcb[t].waitingMutex;
+    }
+    putsUart0("\n");
+}
+
+// Passes a mutex to its best waiter or frees it, whatever the lock count
+static void releaseMutex(uint8_t slot)
+{
+    waitQueue *q = &objects[slot].u.mtx.waiters;
+    volatile uint32_t *word = &IPC_SHARED->word[slot];
+    uint8_t owner = objects[slot].u.mtx.heldBy;
+    uint8_t next = q->head;
+
+    if (owner == NO_TASK)
+        owner = mutexOwner(slot);
+    detachHeldMutex(slot);
+    statReleased(slot);
+
+    if (next != NO_TASK)
+    {
+        statWaited(slot, next);
+        wakeTask(next, tcb[next].waitResult);
+        tcb[next].waitingMutex = NO_OBJECT;
+        *word = (*word & MUTEX_RECURSIVE) | MUTEX_COUNT_ONE | (next + 1) |
+                (q->head != NO_TASK ? MUTEX_WAITERS : 0);
+        attachHeldMutex(next, slot);
+        updateInheritedPriority(next);
+        NVIC_INT_CTRL_R |= (1 << 28);
+    }
+    else
+    {
+        *word &= MUTEX_RECURSIVE;
+    }
+
+    if (owner < MAX_TASKS)
+        updateInheritedPriority(owner);
+}
+
+// Hands every mutex a task holds to the next waiter, newest first,
+// then any taken on the fast path the kernel never saw
+static void releaseHeldMutexes(uint8_t task)
+{
+    uint8_t slot;
+
+    while (tcb[task].heldMutexes != NO_OBJECT)
+        releaseMutex(tcb[task].heldMutexes);
+    for (slot = 0; slot < MAX_OBJECTS; slot++)
+    {
+        if (objects[slot].type == OBJ_MUTEX && mutexOwner(slot) == task)
+            releaseMutex(slot);
+    }
+    tcb[task].currentPriority = tcb[task].priority;
+}
+
+// A signalled or timed out condition waiter takes the mutex if it is free,
+// otherwise it joins the mutex queue and gets result once it is handed over
+static void requeueOnMutex(uint8_t task, int32_t result)
+{
+    uint8_t slot = objectSlot(tcb[task].condMutex, OBJ_MUTEX);
+
+    if (tcb[task].blockedOn != 0)
+        unlinkWaiter(task);
+
+    if (slot == MAX_OBJECTS)
+    {
+        wakeTask(task, RTOS_ERR_DELETED);
+        return;
+    }
+
+    volatile uint32_t *word = &IPC_SHARED->word[slot];
+    uint8_t owner = mutexOwner(slot);
+
+    if (!mutexOwnerValid(slot))
+    {
+        wakeTask(task, RTOS_ERR_INVALID);
+        NVIC_INT_CTRL_R |= (1 << 28);
+    }
+    else if (owner == 0xFF)
+    {
+        *word = (*word & MUTEX_RECURSIVE) | MUTEX_COUNT_ONE | (task + 1);
+        attachHeldMutex(task, slot);
+        statAcquired(slot);
+        wakeTask(task, result);
+        NVIC_INT_CTRL_R |= (1 << 28);
+    }
+    else
+    {
+        *word |= MUTEX_WAITERS;
+        if (objects[slot].u.mtx.heldBy != owner)
+            attachHeldMutex(owner, slot);
+
+        insertWaiter(&objects[slot].u.mtx.waiters, task);
+        statBlocked(slot, task);
+        tcb[task].state        = STATE_BLOCKED_MUTEX;
+        tcb[task].ticks        = WAIT_FOREVER;
+        tcb[task].waitingMutex = slot;
+        tcb[task].waitResult   = result;
+
+        if (priorityInheritance)
+            inheritPriority(owner, tcb[task].currentPriority);
+    }
+}
+
+// Semaphores with a token, queues with a message and flag groups with any bit set
+static bool isObjectReady(uint8_t slot)
+{
+    switch (objects[slot].type)
+    {
+        case OBJ_SEMAPHORE: return (IPC_SHARED->word[slot] & SEM_COUNT_M) > 0;
+        case OBJ_QUEUE:     return objects[slot].u.q.count > 0;
+        case OBJ_FLAGS:     return objects[slot].u.flags.bits != 0;
+    }
+    return false;
+}
+
+static void stopPolling(uint8_t task)
+{
+    uint8_t slot;
+
+    for (slot = 0; slot < MAX_OBJECTS; slot++)
+        objects[slot].pollers &= ~(1 << task);
+    tcb[task].pollCount = 0;
+}
+
+// Every waitAny caller polling this object returns the index it passed it at
+static void wakePollers(uint8_t slot)
+{
+    uint16_t pollers = objects[slot].pollers;
+    uint8_t task, i;
+
+    for (task = 0; task < MAX_TASKS && pollers != 0; task++)
+    {
+        if (!(pollers & (1 << task)))
+            continue;
+        pollers &= ~(1 << task);
+
+        i = 0;
+        while (i < tcb[task].pollCount && HANDLE_SLOT(tcb[task].pollHandles[i]) != slot)
+            i++;
+        stopPolling(task);
+        wakeTask(task, i);
+        NVIC_INT_CTRL_R |= (1 << 28);
+    }
+}
+
+// Readers may enter unless a writer holds the lock or an equal or better
+// priority writer is waiting for it
+static bool readersMayEnter(rwlock *rw, uint8_t task)
+{
+    return rw->writer == NO_TASK &&
+           (rw->writers.head == NO_TASK ||
+            tcb[task].currentPriority < tcb[rw->writers.head].currentPriority);
+}
+
+// Hands a free or read-only lock to whoever is next in line
+static void grantRwLock(rwlock *rw)
+{
+    bool woken = false;
+
+    if (rw->writer != NO_TASK)
+        return;
+
+    while (rw->readers.head != NO_TASK && readersMayEnter(rw, rw->readers.head))
+    {
+        uint8_t reader = rw->readers.head;
+        wakeTask(reader, RTOS_OK);
+        rw->readHolders |= 1 << reader;
+        rw->readCount++;
+        woken = true;
+    }
+
+    if (rw->readCount == 0 && rw->writers.head != NO_TASK)
+    {
+        uint8_t writer = rw->writers.head;
+        wakeTask(writer, RTOS_OK);
+        rw->writer = writer;
+        woken = true;
+    }
+
+    if (woken)
+        NVIC_INT_CTRL_R |= (1 << 28);
+}
+
+// A writer leaving the queue by timeout or kill may let readers in
+static void retryRwLock(waitQueue *q)
+{
+    uint8_t slot;
+
+    for (slot = 0; slot < MAX_OBJECTS; slot++)
+    {
+        if (objects[slot].type == OBJ_RWLOCK && q == &objects[slot].u.rw.writers)
         {
-            if (tcb[i].ticks > 0)
-            {
-                tcb[i].ticks--;
-                if (tcb[i].ticks == 0)
-                {
-                    tcb[i].state = STATE_READY;
-                    needSwitch = true;
-                }
-            }
+            grantRwLock(&objects[slot].u.rw);
+            break;
         }
     }
+}
 
-    // Every 2s compute %CPU per task
-    static uint16_t msCounter = 0;
-    msCounter++;
+// Drops every read and write lock a task holds, its queue entry must already
+// be gone so a write it was waiting for no longer holds readers back
+static void releaseRwLocks(uint8_t task)
+{
+    uint8_t slot;
 
-    if (msCounter >= 2000)
+    for (slot = 0; slot < MAX_OBJECTS; slot++)
     {
-        msCounter = 0;
+        rwlock *rw = &objects[slot].u.rw;
+        if (objects[slot].type != OBJ_RWLOCK)
+            continue;
 
-        // Sum total time used by all valid tasks
-        uint32_t totalTicks = 0;
-        int i;
-        for (i = 0; i < MAX_TASKS; i++)
+        if (rw->writer == task)
+            rw->writer = NO_TASK;
+        if (rw->readHolders & (1 << task))
         {
-            if (tcb[i].state != STATE_INVALID && tcb[i].pid != 0)
-                totalTicks += tcb[i].runTime;
+            rw->readHolders &= ~(1 << task);
+            rw->readCount--;
         }
-        if (totalTicks == 0)
-            totalTicks = 1;  // avoid divide-by-zero
+        grantRwLock(rw);
+    }
+}
 
-        // Compute percentage for each task
-        for (i = 0; i < MAX_TASKS; i++)
+static void copyBytes(void *dst, const void *src, uint32_t size)
+{
+    uint8_t *d = (uint8_t *)dst;
+    const uint8_t *s = (const uint8_t *)src;
+
+    while (size--)
+        *d++ = *s++;
+}
+
+// Copies a client's request into a server's receive buffer, returns the
+// client id msgReply expects
+static int32_t deliverRequest(uint8_t client, msgBuf *buf)
+{
+    uint32_t size = tcb[client].request.size;
+    if (size > buf->size)
+        size = buf->size;
+
+    copyBytes(buf->data, tcb[client].request.data, size);
+    buf->size = size;
+    tcb[client].state = STATE_REPLY_BLOCKED;
+    return client + 1;
+}
+
+// Fails every client of a dying server and drops a dying client's donation
+static void abortMessages(uint8_t task)
+{
+    uint8_t client;
+
+    for (client = 0; client < MAX_TASKS; client++)
+    {
+        if ((tcb[client].state == STATE_SEND_BLOCKED || tcb[client].state == STATE_REPLY_BLOCKED) &&
+            tcb[client].msgServer == task)
         {
-            if (tcb[i].state != STATE_INVALID && tcb[i].pid != 0)
-            {
-                // Scale by 100
-                tcb[i].cpuPercent = (tcb[i].runTime * 10000UL) / totalTicks;
-                tcb[i].runTime = 0;   // clear for next
-            }
+            tcb[client].msgServer = NO_TASK;
+            wakeTask(client, RTOS_ERR_DELETED);
+            NVIC_INT_CTRL_R |= (1 << 28);
         }
     }
 
-    // PendSV only if switch needed
-    if (needSwitch && preemption)
-        NVIC_INT_CTRL_R |= (1 << 28);
+    if ((tcb[task].state == STATE_SEND_BLOCKED || tcb[task].state == STATE_REPLY_BLOCKED) &&
+        tcb[task].msgServer < MAX_TASKS)
+    {
+        uint8_t server = tcb[task].msgServer;
+        tcb[task].msgServer = NO_TASK;
+        updateInheritedPriority(server);
+    }
+    tcb[task].msgServer = NO_TASK;
 }
 
+static uint32_t pipePut(pipe *p, const uint8_t *src, uint32_t size)
+{
+    uint32_t n = 0;
+    while (n < size && p->count < p->size)
+    {
+        p->buffer[(p->head + p->count) % p->size] = src[n++];
+        p->count++;
+    }
+    return n;
+}
 
-// REQUIRED: in coop and preemptive, modify this function to add support for task switching
-// REQUIRED: process UNRUN and READY tasks differently
-//void pendSvIsr(void)
-//{
-// left pendsv in faults.c
-//}
+static uint32_t pipeGet(pipe *p, uint8_t *dst, uint32_t size)
+{
+    uint32_t n = 0;
+    while (n < size && p->count > 0)
+    {
+        dst[n++] = p->buffer[p->head];
+        p->head = (p->head + 1) % p->size;
+        p->count--;
+    }
+    return n;
+}
 
+// Bytes the head reader waits for before it is woken
+static uint32_t pipeThreshold(pipe *p, uint8_t reader)
+{
+    return tcb[reader].pipeBuf.size < p->trigger ? tcb[reader].pipeBuf.size : p->trigger;
+}
 
-// REQUIRED: modify this function to add support for the service call
-// REQUIRED: in preemptive code, add code to handle synchronization primitives
-void svCallIsr(void)
+// Moves blocked writers' data in and hands it to readers until neither side
+// can make progress, the blocked tasks' buffers are outside the current SRD mask
+static void pipeService(pipe *p)
 {
-    uint32_t *psp;
-    uint16_t *pc;
-    uint8_t svc_number;
+    uint32_t savedMask = tcb[taskCurrent].srd;
+    bool progress = true;
 
-    psp = (uint32_t *)getPsp();
+    applySramAccessMask(0x00000000);
+    while (progress)
+    {
+        progress = false;
 
-    pc = (uint16_t *)(psp[6] - 2);
+        while (p->writers.head != NO_TASK && p->count < p->size)
+        {
+            uint8_t writer = p->writers.head;
+            msgBuf *buf = &tcb[writer].pipeBuf;
 
-    svc_number = ((uint8_t *)pc)[0];
+            tcb[writer].pipeDone += pipePut(p, (uint8_t *)buf->data + tcb[writer].pipeDone,
+                                            buf->size - tcb[writer].pipeDone);
+            progress = true;
+            if (tcb[writer].pipeDone < buf->size)
+                break;
+            wakeTask(writer, (int32_t)tcb[writer].pipeDone);
+            NVIC_INT_CTRL_R |= (1 << 28);
+        }
 
-    //Handle SVC
-    switch (svc_number)
+        if (p->readers.head != NO_TASK && p->count >= pipeThreshold(p, p->readers.head))
+        {
+            uint8_t reader = p->readers.head;
+            uint32_t n = pipeGet(p, (uint8_t *)tcb[reader].pipeBuf.data, tcb[reader].pipeBuf.size);
+            wakeTask(reader, (int32_t)n);
+            NVIC_INT_CTRL_R |= (1 << 28);
+            progress = true;
+        }
+    }
+    applySramAccessMask(savedMask);
+}
+
+// A timed out reader takes whatever is there, a writer keeps what it wrote
+static void pipeTimeout(uint8_t task)
+{
+    uint8_t slot;
+
+    for (slot = 0; slot < MAX_OBJECTS; slot++)
     {
-        int i;
-        case 0: // YIELD
-            NVIC_INT_CTRL_R |= (1<<28);
+        pipe *p = &objects[slot].u.p;
+        if (objects[slot].type != OBJ_PIPE)
+            continue;
+
+        if (tcb[task].blockedOn == &p->readers)
+        {
+            uint32_t savedMask = tcb[taskCurrent].srd;
+            applySramAccessMask(0x00000000);
+            tcb[task].pipeDone = pipeGet(p, (uint8_t *)tcb[task].pipeBuf.data, tcb[task].pipeBuf.size);
+            applySramAccessMask(savedMask);
+        }
+        if (tcb[task].blockedOn == &p->readers || tcb[task].blockedOn == &p->writers)
+        {
+            wakeTask(task, (int32_t)tcb[task].pipeDone);
+            pipeService(p);
+            break;
+        }
+    }
+}
+
+static void setTopicSamples(uint8_t task, uint8_t samples)
+{
+    tcb[task].topicSamples = samples;
+    if (task == taskCurrent)
+        applyTopicAccessMask(samples);
+}
+
+// Gives a subscriber a reference to the latest sample, returns its length
+static int32_t takeSample(uint8_t task, topic *t, const void **sample)
+{
+    uint8_t s = t->latest;
+
+    sampleRefs[s]++;
+    setTopicSamples(task, tcb[task].topicSamples | (1 << s));
+    t->pending &= ~(1 << task);
+    *sample = topicPool + s * TOPIC_SAMPLE_SIZE;
+    return sampleLength[s];
+}
+
+// Drops every sample a task holds and every subscription it has
+static void releaseTopics(uint8_t task)
+{
+    uint8_t i;
+
+    for (i = 0; i < TOPIC_SAMPLES; i++)
+    {
+        if (tcb[task].topicSamples & (1 << i))
+            sampleRefs[i]--;
+    }
+    setTopicSamples(task, 0);
+
+    for (i = 0; i < MAX_OBJECTS; i++)
+    {
+        if (objects[i].type == OBJ_TOPIC)
+        {
+            objects[i].u.t.subscribers &= ~(1 << task);
+            objects[i].u.t.pending     &= ~(1 << task);
+        }
+    }
+}
+
+// A task leaving a barrier queue early no longer counts as arrived
+static void leaveBarrier(uint8_t task)
+{
+    uint8_t slot;
+
+    for (slot = 0; slot < MAX_OBJECTS; slot++)
+    {
+        if (objects[slot].type == OBJ_BARRIER && tcb[task].blockedOn == &objects[slot].u.b.waiters)
+        {
+            objects[slot].u.b.arrived--;
+            break;
+        }
+    }
+}
+
+// Takes a slot from the pool, INVALID_HANDLE if the pool or heap is exhausted
+static handle allocObject(uint8_t type, uint32_t param, const char name[])
+{
+    uint8_t slot = 0;
+    while (slot < MAX_OBJECTS && objects[slot].type != OBJ_FREE)
+        slot++;
+    if (slot == MAX_OBJECTS)
+        return INVALID_HANDLE;
+
+    kobject *obj = &objects[slot];
+    switch (type)
+    {
+        case OBJ_SEMAPHORE:
+            if (param > SEM_COUNT_M)
+                return INVALID_HANDLE;
+            initWaitQueue(&obj->u.sem.waiters);
+            IPC_SHARED->word[slot] = param;
+            break;
+        case OBJ_MUTEX:
+            initWaitQueue(&obj->u.mtx.waiters);
+            obj->u.mtx.nextHeld = NO_OBJECT;
+            obj->u.mtx.heldBy = NO_TASK;
+            IPC_SHARED->word[slot] = param & MUTEX_RECURSIVE;
+            break;
+        case OBJ_QUEUE:
+            if (param == 0 || param > 0xFF)
+                return INVALID_HANDLE;
+            obj->u.q.items = (uint32_t *)malloc_heap(param * sizeof(uint32_t), KERNEL_PID);
+            if (obj->u.q.items == 0)
+                return INVALID_HANDLE;
+            initWaitQueue(&obj->u.q.readers);
+            initWaitQueue(&obj->u.q.writers);
+            obj->u.q.depth = param;
+            obj->u.q.count = 0;
+            obj->u.q.head  = 0;
+            IPC_SHARED->word[slot] = 0;
+            break;
+        case OBJ_RWLOCK:
+            initWaitQueue(&obj->u.rw.readers);
+            initWaitQueue(&obj->u.rw.writers);
+            obj->u.rw.writer      = NO_TASK;
+            obj->u.rw.readCount   = 0;
+            obj->u.rw.readHolders = 0;
+            IPC_SHARED->word[slot] = 0;
+            break;
+        case OBJ_CONDVAR:
+            initWaitQueue(&obj->u.cv.waiters);
+            IPC_SHARED->word[slot] = 0;
+            break;
+        case OBJ_FLAGS:
+            initWaitQueue(&obj->u.flags.waiters);
+            obj->u.flags.bits = 0;
+            IPC_SHARED->word[slot] = 0;
+            break;
+        case OBJ_PIPE:
+            if (param == 0 || param > 0xFFFF)
+                return INVALID_HANDLE;
+            obj->u.p.buffer = (uint8_t *)malloc_heap(param, KERNEL_PID);
+            if (obj->u.p.buffer == 0)
+                return INVALID_HANDLE;
+            initWaitQueue(&obj->u.p.readers);
+            initWaitQueue(&obj->u.p.writers);
+            obj->u.p.size    = param;
+            obj->u.p.count   = 0;
+            obj->u.p.head    = 0;
+            obj->u.p.trigger = 1;
+            IPC_SHARED->word[slot] = 0;
+            break;
+        case OBJ_TOPIC:
+            if (param == 0 || param > TOPIC_SAMPLE_SIZE)
+                return INVALID_HANDLE;
+            initWaitQueue(&obj->u.t.waiters);
+            obj->u.t.subscribers = 0;
+            obj->u.t.pending     = 0;
+            obj->u.t.size        = param;
+            obj->u.t.latest      = NO_SAMPLE;
+            IPC_SHARED->word[slot] = 0;
+            break;
+        case OBJ_BARRIER:
+            if (param == 0 || param > MAX_TASKS)
+                return INVALID_HANDLE;
+            initWaitQueue(&obj->u.b.waiters);
+            obj->u.b.parties = param;
+            obj->u.b.arrived = 0;
+            obj->u.b.phase   = 0;
+            IPC_SHARED->word[slot] = 0;
+            break;
+        default:
+            return INVALID_HANDLE;
+    }
+
+    uint8_t j = 0;
+    if (name != 0)
+    {
+        while (name[j] != '\0' && j < OBJECT_NAME_SIZE - 1)
+        {
+            obj->name[j] = name[j];
+            j++;
+        }
+    }
+    obj->name[j] = '\0';
+    obj->type = type;
+    obj->pollers = 0;
+
+    handle h = ((handle)obj->generation << 8) | slot;
+    clearStats(slot);
+    IPC_SHARED->tag[slot] = fastPathTag(slot);
+    return h;
+}
+
+// Returns the slot to the pool, every waiter fails with RTOS_ERR_DELETED
+static void freeObject(uint8_t slot)
+{
+    kobject *obj = &objects[slot];
+    switch (obj->type)
+    {
+        case OBJ_SEMAPHORE:
+            wakeAll(&obj->u.sem.waiters, RTOS_ERR_DELETED);
+            break;
+        case OBJ_MUTEX:
+            wakeAll(&obj->u.mtx.waiters, RTOS_ERR_DELETED);
+            if (obj->u.mtx.heldBy != NO_TASK)
+            {
+                uint8_t owner = obj->u.mtx.heldBy;
+                detachHeldMutex(slot);
+                updateInheritedPriority(owner);
+            }
+            break;
+        case OBJ_QUEUE:
+            wakeAll(&obj->u.q.readers, RTOS_ERR_DELETED);
+            wakeAll(&obj->u.q.writers, RTOS_ERR_DELETED);
+            free_heap(obj->u.q.items, KERNEL_PID);
+            obj->u.q.items = 0;
+            break;
+        case OBJ_RWLOCK:
+            wakeAll(&obj->u.rw.readers, RTOS_ERR_DELETED);
+            wakeAll(&obj->u.rw.writers, RTOS_ERR_DELETED);
+            break;
+        case OBJ_CONDVAR:
+            wakeAll(&obj->u.cv.waiters, RTOS_ERR_DELETED);
+            break;
+        case OBJ_FLAGS:
+            wakeAll(&obj->u.flags.waiters, 0);
+            break;
+        case OBJ_PIPE:
+            wakeAll(&obj->u.p.readers, RTOS_ERR_DELETED);
+            wakeAll(&obj->u.p.writers, RTOS_ERR_DELETED);
+            free_heap(obj->u.p.buffer, KERNEL_PID);
+            obj->u.p.buffer = 0;
+            break;
+        case OBJ_TOPIC:
+            // Samples already taken stay valid until released
+            wakeAll(&obj->u.t.waiters, RTOS_ERR_DELETED);
+            if (obj->u.t.latest != NO_SAMPLE)
+                sampleRefs[obj->u.t.latest]--;
+            break;
+        case OBJ_BARRIER:
+            wakeAll(&obj->u.b.waiters, RTOS_ERR_DELETED);
+            break;
+    }
+
+    while (obj->pollers != 0)
+    {
+        uint8_t task = 0;
+        while (!(obj->pollers & (1 << task)))
+            task++;
+        stopPolling(task);
+        wakeTask(task, RTOS_ERR_DELETED);
+    }
+
+    obj->type = OBJ_FREE;
+    if (++obj->generation == 0)
+        obj->generation = 1;
+    IPC_SHARED->tag[slot]  = 0;
+    IPC_SHARED->word[slot] = 0;
+
+    NVIC_INT_CTRL_R |= (1 << 28);
+}
+
+static bool isPrivileged(void)
+{
+    return (getControl() & 1) == 0;
+}
+
+__attribute__((naked)) static handle svcCreateObject(uint8_t type, uint32_t param, const char name[])
+{
+    __asm("  SVC #19");
+    __asm("  BX LR");
+}
+
+__attribute__((naked)) static int32_t svcDeleteObject(handle h)
+{
+    __asm("  SVC #20");
+    __asm("  BX LR");
+}
+
+// Objects may be created by main before startRtos or by tasks at run time
+handle createSemaphore(uint16_t count, const char name[])
+{
+    if (isPrivileged())
+        return allocObject(OBJ_SEMAPHORE, count, name);
+    return svcCreateObject(OBJ_SEMAPHORE, count, name);
+}
+
+handle createMutex(const char name[])
+{
+    if (isPrivileged())
+        return allocObject(OBJ_MUTEX, 0, name);
+    return svcCreateObject(OBJ_MUTEX, 0, name);
+}
+
+// The owner may lock again, each lock needs a matching unlock
+handle createRecursiveMutex(const char name[])
+{
+    if (isPrivileged())
+        return allocObject(OBJ_MUTEX, MUTEX_RECURSIVE, name);
+    return svcCreateObject(OBJ_MUTEX, MUTEX_RECURSIVE, name);
+}
+
+handle createQueue(uint8_t depth, const char name[])
+{
+    if (isPrivileged())
+        return allocObject(OBJ_QUEUE, depth, name);
+    return svcCreateObject(OBJ_QUEUE, depth, name);
+}
+
+handle createRwLock(const char name[])
+{
+    if (isPrivileged())
+        return allocObject(OBJ_RWLOCK, 0, name);
+    return svcCreateObject(OBJ_RWLOCK, 0, name);
+}
+
+handle createCondition(const char name[])
+{
+    if (isPrivileged())
+        return allocObject(OBJ_CONDVAR, 0, name);
+    return svcCreateObject(OBJ_CONDVAR, 0, name);
+}
+
+handle createFlags(const char name[])
+{
+    if (isPrivileged())
+        return allocObject(OBJ_FLAGS, 0, name);
+    return svcCreateObject(OBJ_FLAGS, 0, name);
+}
+
+handle createPipe(uint16_t size, const char name[])
+{
+    if (isPrivileged())
+        return allocObject(OBJ_PIPE, size, name);
+    return svcCreateObject(OBJ_PIPE, size, name);
+}
+
+handle createTopic(uint16_t sampleSize, const char name[])
+{
+    if (isPrivileged())
+        return allocObject(OBJ_TOPIC, sampleSize, name);
+    return svcCreateObject(OBJ_TOPIC, sampleSize, name);
+}
+
+handle createBarrier(uint8_t parties, const char name[])
+{
+    if (isPrivileged())
+        return allocObject(OBJ_BARRIER, parties, name);
+    return svcCreateObject(OBJ_BARRIER, parties, name);
+}
+
+int32_t deleteObject(handle h)
+{
+    if (isPrivileged())
+    {
+        uint8_t slot = HANDLE_SLOT(h);
+        if (slot >= MAX_OBJECTS || objects[slot].type == OBJ_FREE ||
+            objects[slot].generation != HANDLE_GENERATION(h))
+            return RTOS_ERR_INVALID;
+        freeObject(slot);
+        return RTOS_OK;
+    }
+    return svcDeleteObject(h);
+}
+
+// Tasks look up objects created in main by name
+__attribute__((naked)) handle findObject(const char name[])
+{
+    __asm("  SVC #21");
+    __asm("  BX LR");
+}
+
+unsigned int stringLen(const char *s)
+{
+    unsigned int len = 0;
+    while (s[len] != '\0')
+        len++;
+    return len;
+}
+
+static void putPadding(unsigned int used, unsigned int width)
+{
+    while (used++ < width)
+        putcUart0(' ');
+}
+
+// Waiter count followed by the waiting task names in wake order
+static void printWaiters(const char label[], waitQueue *q)
+{
+    char str[12];
+    uint8_t count = 0;
+    uint8_t task;
+
+    for (task = q->head; task != NO_TASK; task = tcb[task].nextWaiter)
+        count++;
+
+    putsUart0((char *)label);
+    itoa(count, str, 10);
+    putsUart0(str);
+
+    if (count > 0)
+    {
+        putsUart0(" [");
+        for (task = q->head; task != NO_TASK; task = tcb[task].nextWaiter)
+        {
+            putsUart0(tcb[task].name);
+            if (tcb[task].nextWaiter != NO_TASK)
+                putsUart0(", ");
+        }
+        putsUart0("]");
+    }
+}
+
+// ipcs -d, mutex waits name their owner and are flagged when the owners
+// wait on each other in a cycle, semaphores have no owner to blame
+static void printWaitFor(void)
+{
+    uint8_t task;
+    bool any = false;
+
+    putsUart0("\nTASK            WAITS FOR\n");
+    putsUart0("------------------------------------------------------\n");
+    for (task = 0; task < MAX_TASKS; task++)
+    {
+        if (tcb[task].state == STATE_BLOCKED_MUTEX)
+        {
+            uint8_t slot = tcb[task].waitingMutex;
+            uint8_t owner = mutexOwner(slot);
+
+            putsUart0(tcb[task].name);
+            putPadding(stringLen(tcb[task].name), 16);
+            putsUart0("MUTEX ");
+            putsUart0(objects[slot].name);
+            putsUart0(" held by ");
+            putsUart0(owner < MAX_TASKS ? tcb[owner].name : "---");
+            if (closesCycle(task, owner))
+                putsUart0("  DEADLOCK");
+            putsUart0("\n");
+            any = true;
+        }
+        else if (tcb[task].state == STATE_BLOCKED_SEMAPHORE)
+        {
+            putsUart0(tcb[task].name);
+            putPadding(stringLen(tcb[task].name), 16);
+            putsUart0("SEM ");
+            putsUart0(objects[tcb[task].waitingSemaphore].name);
+            putsUart0(" (any poster)\n");
+            any = true;
+        }
+    }
+    if (!any)
+        putsUart0("no tasks blocked on mutexes or semaphores\n");
+}
+
+static void printUs(const char label[], uint64_t total, uint32_t count, uint32_t max)
+{
+    char str[12];
+
+    putsUart0((char *)label);
+    itoa(count > 0 ? (uint32_t)(total / count / CYCLES_PER_US) : 0, str, 10);
+    putsUart0(str);
+    putcUart0('/');
+    itoa(max / CYCLES_PER_US, str, 10);
+    putsUart0(str);
+    putsUart0("us");
+}
+
+// Second ipcs line for mutexes and semaphores, times are avg/max
+static void printLockStats(lockStats *s, bool isMutex)
+{
+    char str[12];
+
+    putsUart0("         acq=");
+    itoa(s->acquisitions, str, 10);
+    putsUart0(str);
+    putsUart0("  contended=");
+    itoa(s->contended, str, 10);
+    putsUart0(str);
+    printUs("  wait=", s->waitCycles, s->contended, s->maxWait);
+    if (isMutex)
+        printUs("  hold=", s->holdCycles, s->holds, s->maxHold);
+    putsUart0("\n");
+}
+
+// Kernel critical section, masks every exception at or below the kernel
+// priority while leaving higher priority interrupts untouched
+uint32_t enterCritical(void)
+{
+    uint32_t basepri = getBasepri();
+    setBasepriMax(PRIORITY_TO_BASEPRI(KERNEL_INTERRUPT_PRIORITY));
+    return basepri;
+}
+
+void leaveCritical(uint32_t basepri)
+{
+    setBasepri(basepri);
+}
+
+// PendSV runs last so a context switch never preempts SVC or SysTick
+void initExceptionPriorities(void)
+{
+    NVIC_SYS_PRI2_R = (NVIC_SYS_PRI2_R & ~NVIC_SYS_PRI2_SVC_M)
+                    | (SVC_PRIORITY << NVIC_SYS_PRI2_SVC_S);
+    NVIC_SYS_PRI3_R = (NVIC_SYS_PRI3_R & ~(NVIC_SYS_PRI3_TICK_M | NVIC_SYS_PRI3_PENDSV_M))
+                    | (SYSTICK_PRIORITY << NVIC_SYS_PRI3_TICK_S)
+                    | (PENDSV_PRIORITY << NVIC_SYS_PRI3_PENDSV_S);
+}
+
+// REQUIRED: initialize systick for 1ms system timer
+void initRtos(void)
+{
+    uint8_t i;
+
+    // Paint the unused part of the MSP stack, leaving this frame alone
+    uint32_t *word = &__stack;
+    while (word < (uint32_t *)getMsp() - 16)
+        *word++ = STACK_PAINT;
+
+    // Initialize ALL TCB entries to INVALID
+    for (i = 0; i < MAX_TASKS; i++)
+    {
+        tcb[i].state = STATE_INVALID;
+        tcb[i].pid = 0;
+        tcb[i].sp = 0;
+        tcb[i].blockedOn = 0;
+        tcb[i].nextWaiter = NO_TASK;
+        initWaitQueue(&tcb[i].senders);
+        tcb[i].msgServer = NO_TASK;
+    }
+    for (i = 0; i < FUTEX_BUCKETS; i++)
+        initWaitQueue(&futexTable[i]);
+    for (i = 0; i < MAX_OBJECTS; i++)
+    {
+        objects[i].type       = OBJ_FREE;
+        objects[i].generation = 1;
+    }
+    taskCount = 0;
+    taskCurrent = 0xFF; // No current task
+
+    initExceptionPriorities();
+
+    // Shared IPC block must be the first heap allocation and a whole block,
+    // never a slab shared with other kernel objects
+    uint32_t *shared = (uint32_t *)malloc_heap_aligned(sizeof(ipcShared), BLOCK_SIZE, KERNEL_PID);
+    if (shared != (uint32_t *)IPC_SHARED)
+        while (1);
+    for (i = 0; i < sizeof(ipcShared) / sizeof(uint32_t); i++)
+        shared[i] = 0;
+
+    // Topic samples are read through MPU region 7 which needs natural alignment
+    topicPool = (uint8_t *)malloc_heap_aligned(TOPIC_POOL_SIZE, TOPIC_POOL_SIZE, KERNEL_PID);
+    if (topicPool == 0)
+        while (1);
+    for (i = 0; i < TOPIC_SAMPLES; i++)
+        sampleRefs[i] = 0;
+    setupTopicAccess((uint32_t)topicPool);
+
+    stats = (lockStats *)malloc_heap(MAX_OBJECTS * sizeof(lockStats), KERNEL_PID);
+    if (stats == 0)
+        while (1);
+    resetStats();
+
+    // Cycle counter for benchmarks
+    NVIC_DBG_INT_R |= DEMCR_TRCENA;
+    DWT_CYCCNT_R = 0;
+    DWT_CTRL_R |= DWT_CTRL_CYCCNTENA;
+
+    NVIC_ST_CTRL_R = 0;
+    NVIC_ST_RELOAD_R = 40000 - 1;
+    NVIC_ST_CURRENT_R = 0;
+    NVIC_ST_CTRL_R = NVIC_ST_CTRL_CLK_SRC
+                   | NVIC_ST_CTRL_INTEN
+                   | NVIC_ST_CTRL_ENABLE;
+}
+
+// REQUIRED: Implement prioritization to NUM_PRIORITIES
+uint8_t rtosScheduler(void)
+{
+    //  Round Robin scheduler
+    if (!priorityScheduler)
+    {
+        static uint8_t task = 0xFF;
+        uint8_t count = 0;
+
+        while (count < MAX_TASKS)
+        {
+            task++;
+            if (task >= MAX_TASKS)
+                task = 0;
+
+            if ((tcb[task].state == STATE_READY || tcb[task].state == STATE_UNRUN) &&
+                tcb[task].state != STATE_INVALID &&
+                tcb[task].state != STATE_KILLED &&
+                tcb[task].pid != 0)
+            {
+                return task;
+            }
+
+            count++;
+        }
+        putsUart0("No READY tasks (RR)!\n");
+        while (1);
+    }
+
+    //  Priority based scheduler
+    uint8_t bestPriority = NUM_PRIORITIES;
+    uint8_t nextTask = 0xFF;
+    uint8_t i, j;
+
+    // Find best priority among READY/UNRUN tasks
+    for (i = 0; i < MAX_TASKS; i++)
+    {
+        if ((tcb[i].state == STATE_READY || tcb[i].state == STATE_UNRUN) &&
+            tcb[i].state != STATE_INVALID &&
+            tcb[i].state != STATE_KILLED &&
+            tcb[i].pid != 0)
+        {
+            if (tcb[i].currentPriority < bestPriority)
+                bestPriority = tcb[i].currentPriority;
+        }
+    }
+
+    if (bestPriority == NUM_PRIORITIES)
+    {
+        putsUart0("No READY tasks!\n");
+        while (1);
+    }
+
+    // Round robin within priority, starting after current task
+    uint8_t start = priorityIndex[bestPriority];
+
+    for (j = 0; j < MAX_TASKS; j++)
+    {
+        uint8_t i = (start + j) % MAX_TASKS;
+
+        // Skip current task AND check if ready
+        if (i != taskCurrent &&
+            (tcb[i].state == STATE_READY || tcb[i].state == STATE_UNRUN) &&
+            tcb[i].state != STATE_INVALID &&
+            tcb[i].state != STATE_KILLED &&
+            tcb[i].pid != 0 &&
+            tcb[i].currentPriority == bestPriority)
+        {
+            nextTask = i;
+            priorityIndex[bestPriority] = (i + 1) % MAX_TASKS;
+            break;
+        }
+    }
+
+    // Didn't find a different task, keep current
+    if (nextTask == 0xFF)
+    {
+        if (tcb[taskCurrent].state == STATE_READY || tcb[taskCurrent].state == STATE_UNRUN)
+            nextTask = taskCurrent;
+        else
+        {
+            putsUart0("No valid task found!\n");
+            while (1);
+        }
+    }
+
+    return nextTask;
+}
+
+// REQUIRED: modify this function to start the operating system
+// by calling scheduler, set srd bits, setting PSP, ASP bit, call fn with fn add in R0
+// fn set TMPL bit, and PC <= fn
+void startRtos(void)
+{
+    taskCurrent = rtosScheduler();
+
+    tcb[taskCurrent].state = STATE_READY;
+    IPC_SHARED->current = taskCurrent + 1;
+
+    disableMpu();
+    applySramAccessMask(tcb[taskCurrent].srd);
+    setupStackRegion((uint32_t)tcb[taskCurrent].stackBase, tcb[taskCurrent].stackSize,
+                     tcb[taskCurrent].stackExtra == 0);
+    applyTopicAccessMask(tcb[taskCurrent].topicSamples);
+    enableMpu();
+
+    uint32_t sp = (uint32_t)tcb[taskCurrent].sp;
+    setPsp(sp);
+
+    setAsp();
+
+    _fn fn = (_fn)tcb[taskCurrent].pid;
+
+    switchToUnpriv();
+
+    fn();
+}
+
+// REQUIRED:
+// add task if room in task list
+// store the thread name
+// allocate stack space and store top of stack in sp and spInit
+// set the srd bits based on the memory allocation
+// the guard subregion is taken from the bottom of the region, so the task
+// may use seven eighths of stackBytes rounded up to a power of two
+bool createThread(_fn fn, const char name[], uint8_t priority, uint32_t stackBytes)
+{
+    bool ok = false;
+    uint8_t i = 0;
+    bool found = false;
+    if (taskCount < MAX_TASKS)
+    {
+        while (!found && (i < MAX_TASKS))
+        {
+            found = (tcb[i++].pid == fn);
+        }
+        if (!found)
+        {
+            //Find first available TCB entry
+            i = 0;
+            while (tcb[i].state != STATE_INVALID && i < MAX_TASKS)
+                i++;
+            if (i < MAX_TASKS)
+            {
+                // Stack is rounded up to a power of two so region 4 covers it exactly
+                stackBytes = heapRegionSize(stackBytes);
+                uint8_t *stackBase = (uint8_t *)malloc_heap_region(stackBytes, (uint16_t)(i + 1));
+                if (stackBase == 0)
+                    return false;   // allocation failed
+                uint8_t *stackTop = stackBase + stackBytes;
+                // 8 byte alignment
+                stackTop = (uint8_t *)(((uint32_t)stackTop) & 0xFFFFFFF8);
+                // TCB fields
+                tcb[i].state           = STATE_UNRUN;
+                tcb[i].pid             = fn;
+                tcb[i].priority        = priority;
+                tcb[i].currentPriority = priority;
+                tcb[i].ticks           = 0;
+                tcb[i].sp              = (void *)stackTop;   // PSP starts at top of stack
+                tcb[i].heldMutexes     = NO_OBJECT;
+                tcb[i].waitingMutex    = NO_OBJECT;
+                tcb[i].stackBase       = stackBase;
+                tcb[i].stackSize       = stackBytes;
+                tcb[i].heapQuota       = TASK_HEAP_QUOTA;
+                tcb[i].stackExtra      = 0;
+                tcb[i].stackGrowMax    = 0;
+                paintStack(i);
+                tcb[i].blockedOn       = 0;
+                tcb[i].nextWaiter      = NO_TASK;
+                tcb[i].resultPending   = false;
+                tcb[i].notifyValue     = 0;
+                tcb[i].notifyPending   = false;
+                tcb[i].msgServer       = NO_TASK;
+                initWaitQueue(&tcb[i].senders);
+                tcb[i].topicSamples    = 0;
+
+                // Copy the thread name
+                uint8_t j = 0;
+                while (name[j] != '\0' && j < sizeof(tcb[i].name) - 1)
+                {
+                    tcb[i].name[j] = name[j];
+                    j++;
+                }
+                tcb[i].name[j] = '\0';
+
+                // MPU SRD mask for this stack region
+                tcb[i].srd = createTaskSramMask();
+
+                taskCount++;
+                ok = true;
+            }
+        }
+    }
+    return ok;
+}
+
+// Called before startRtos, like createThread
+bool setHeapQuota(_fn fn, uint8_t blocks)
+{
+    uint8_t i;
+
+    for (i = 0; i < MAX_TASKS; i++)
+    {
+        if (tcb[i].state != STATE_INVALID && tcb[i].pid == fn)
+        {
+            tcb[i].heapQuota = blocks;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Lets the stack grow below its region by up to maxBytes, a block at a
+// time, called before startRtos
+bool setStackGrowth(_fn fn, uint32_t maxBytes)
+{
+    uint8_t i;
+
+    for (i = 0; i < MAX_TASKS; i++)
+    {
+        if (tcb[i].state != STATE_INVALID && tcb[i].pid == fn)
+        {
+            tcb[i].stackGrowMax = maxBytes & ~(BLOCK_SIZE - 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void printBytes(const char label[], uint32_t bytes)
+{
+    char str[12];
+
+    putsUart0((char *)label);
+    itoa(bytes, str, 10);
+    putsUart0(str);
+    putsUart0(" bytes\n");
+}
+
+// Boot report of the SRAM split between the linked kernel and the heap,
+// and of what the kernel and the task stacks have taken from the heap
+void printMemoryMap(void)
+{
+    uint32_t stacks = 0;
+    uint8_t i;
+
+    for (i = 0; i < MAX_TASKS; i++)
+    {
+        if (tcb[i].state != STATE_INVALID)
+            stacks |= taskStackBlocks(i);
+    }
+
+    putsUart0("\n=== Memory ===\n");
+    printBytes("kernel:      ", (uint32_t)HEAP_BASE - SRAM_BASE);
+    printBytes("heap:        ", HEAP_SIZE);
+    printHex("heap base:   ", (uint32_t)HEAP_BASE);
+    printBytes("  kernel use: ", countBlocks(heapBlocksOwned(KERNEL_PID)) * BLOCK_SIZE);
+    printBytes("  stacks:     ", countBlocks(stacks) * BLOCK_SIZE);
+    printBytes("  free:       ", freeBlockCount() * BLOCK_SIZE);
+}
+
+// REQUIRED: modify this function to kill a thread
+// REQUIRED: free memory, remove any pending semaphore waiting,
+//           unlock any mutexes, mark state as killed
+// Returns the heap bytes reclaimed, a task killing itself never returns
+//uint32_t killThread(_fn fn)
+//{
+//    Moved to psp_msp.s
+//}
+
+// REQUIRED: modify this function to restart a thread, including creating a stack
+//void restartThread(_fn fn)
+//{
+//    Moved to psp_msp.s
+//}
+
+// REQUIRED: modify this function to set a thread priority
+//void setThreadPriority(_fn fn, uint8_t priority)
+//{
+//    Moved to psp_msp.s
+//}
+
+// REQUIRED: modify this function to yield execution back to scheduler using pendsv
+void yield(void)
+{
+    __asm("    SVC #0");
+    __asm("    BX LR");
+}
+
+// REQUIRED: modify this function to support 1ms system timer
+// execution yielded back to scheduler until time elapses using pendsv
+//void sleep(uint32_t tick)
+//{
+//    Moved to psp_msp.s
+//}
+
+// REQUIRED: modify this function to wait a semaphore using pendsv
+// Takes a token in thread mode, only traps when none is available
+int32_t wait(handle semaphore)
+{
+    uint8_t slot = HANDLE_SLOT(semaphore);
+    if (slot < MAX_OBJECTS && IPC_SHARED->tag[slot] == OBJECT_TAG(OBJ_SEMAPHORE, semaphore))
+    {
+        volatile uint32_t *word = &IPC_SHARED->word[slot];
+        uint32_t w = *word;
+        if ((w & SEM_COUNT_M) > 0 && casWord(word, w, w - 1))
+            return RTOS_OK;
+    }
+    return svcWait(semaphore);
+}
+
+// REQUIRED: modify this function to signal a semaphore is available using pendsv
+// Adds a token in thread mode, only traps when a waiter must be woken
+int32_t post(handle semaphore)
+{
+    uint8_t slot = HANDLE_SLOT(semaphore);
+    if (slot < MAX_OBJECTS && IPC_SHARED->tag[slot] == OBJECT_TAG(OBJ_SEMAPHORE, semaphore))
+    {
+        volatile uint32_t *word = &IPC_SHARED->word[slot];
+        uint32_t w = *word;
+        if (!(w & SEM_WAITERS) && (w & SEM_COUNT_M) < SEM_COUNT_M && casWord(word, w, w + 1))
+            return RTOS_OK;
+    }
+    return svcPost(semaphore);
+}
+
+// REQUIRED: modify this function to lock a mutex using pendsv
+// Uncontended lock and recursive relock are a single LDREX/STREX,
+// contention traps to SVC #2
+int32_t lock(handle mutex)
+{
+    uint8_t slot = HANDLE_SLOT(mutex);
+    if (slot < MAX_OBJECTS && IPC_SHARED->tag[slot] == OBJECT_TAG(OBJ_MUTEX, mutex))
+    {
+        volatile uint32_t *word = &IPC_SHARED->word[slot];
+        uint32_t w = *word;
+        uint32_t self = IPC_SHARED->current;
+
+        if ((w & MUTEX_OWNER_M) == 0 && casWord(word, w, w | self | MUTEX_COUNT_ONE))
+            return RTOS_OK;
+        if ((w & MUTEX_OWNER_M) == self && (w & MUTEX_RECURSIVE) &&
+            (w & MUTEX_COUNT_M) != MUTEX_COUNT_M && casWord(word, w, w + MUTEX_COUNT_ONE))
+            return RTOS_OK;
+    }
+    return svcLock(mutex);
+}
+
+// REQUIRED: modify this function to unlock a mutex using pendsv
+// Releases in thread mode unless the kernel is tracking the mutex,
+// then traps to SVC #3
+int32_t unlock(handle mutex)
+{
+    uint8_t slot = HANDLE_SLOT(mutex);
+    if (slot < MAX_OBJECTS && IPC_SHARED->tag[slot] == OBJECT_TAG(OBJ_MUTEX, mutex))
+    {
+        volatile uint32_t *word = &IPC_SHARED->word[slot];
+        uint32_t w = *word;
+        uint32_t self = IPC_SHARED->current;
+
+        if ((w & MUTEX_OWNER_M) == self && (w & MUTEX_COUNT_M) > MUTEX_COUNT_ONE &&
+            casWord(word, w, w - MUTEX_COUNT_ONE))
+            return RTOS_OK;
+        if (w == ((w & MUTEX_RECURSIVE) | self | MUTEX_COUNT_ONE) &&
+            casWord(word, w, w & MUTEX_RECURSIVE))
+            return RTOS_OK;
+    }
+    return svcUnlock(mutex);
+}
+
+__attribute__((naked)) int32_t svcLock(handle mutex)
+{
+    __asm("  SVC #2");
+    __asm("  BX LR");
+}
+
+__attribute__((naked)) int32_t svcUnlock(handle mutex)
+{
+    __asm("  SVC #3");
+    __asm("  BX LR");
+}
+
+// Blocks up to timeout ticks while the queue is full
+__attribute__((naked)) int32_t queueSend(handle q, uint32_t message, uint32_t timeout)
+{
+    __asm("  SVC #22");
+    __asm("  BX LR");
+}
+
+// Blocks up to timeout ticks while the queue is empty
+__attribute__((naked)) int32_t queueReceive(handle q, uint32_t *message, uint32_t timeout)
+{
+    __asm("  SVC #23");
+    __asm("  BX LR");
+}
+
+// Shared access, blocks up to timeout ticks while written or a writer waits
+__attribute__((naked)) int32_t readLock(handle rw, uint32_t timeout)
+{
+    __asm("  SVC #26");
+    __asm("  BX LR");
+}
+
+__attribute__((naked)) int32_t readUnlock(handle rw)
+{
+    __asm("  SVC #27");
+    __asm("  BX LR");
+}
+
+// Exclusive access, blocks up to timeout ticks while any task holds the lock
+__attribute__((naked)) int32_t writeLock(handle rw, uint32_t timeout)
+{
+    __asm("  SVC #28");
+    __asm("  BX LR");
+}
+
+__attribute__((naked)) int32_t writeUnlock(handle rw)
+{
+    __asm("  SVC #29");
+    __asm("  BX LR");
+}
+
+// Unlocks mutex and sleeps until signalled or timeout ticks pass, then returns
+// with mutex locked again (RTOS_ERR_TIMEOUT still holds it)
+__attribute__((naked)) int32_t condWait(handle cv, handle mutex, uint32_t timeout)
+{
+    __asm("  SVC #30");
+    __asm("  BX LR");
+}
+
+__attribute__((naked)) static int32_t svcCondWake(handle cv, bool all)
+{
+    __asm("  SVC #31");
+    __asm("  BX LR");
+}
+
+int32_t condSignal(handle cv)
+{
+    return svcCondWake(cv, false);
+}
+
+int32_t condBroadcast(handle cv)
+{
+    return svcCondWake(cv, true);
+}
+
+// Sets bits and wakes every waiter whose mask is now satisfied
+__attribute__((naked)) int32_t setFlags(handle flags, uint32_t bits)
+{
+    __asm("  SVC #33");
+    __asm("  BX LR");
+}
+
+__attribute__((naked)) int32_t clearFlags(handle flags, uint32_t bits)
+{
+    __asm("  SVC #34");
+    __asm("  BX LR");
+}
+
+// Returns the flag bits once mask is satisfied, or 0 after timeout ticks
+__attribute__((naked)) uint32_t waitFlags(handle flags, uint32_t mask, uint8_t mode, uint32_t timeout)
+{
+    __asm("  SVC #35");
+    __asm("  BX LR");
+}
+
+// Blocks until any of the semaphores, queues or flag groups is ready and
+// returns its index without taking anything, the caller then uses wait(),
+// queueReceive() or waitFlags() on it
+__attribute__((naked)) int32_t waitAny(const handle objects[], uint8_t count, uint32_t timeout)
+{
+    __asm("  SVC #32");
+    __asm("  BX LR");
+}
+
+// Blocks until the server replies, returns the reply length
+__attribute__((naked)) int32_t msgSend(_fn server, const msgBuf *request, const msgBuf *reply)
+{
+    __asm("  SVC #36");
+    __asm("  BX LR");
+}
+
+// Blocks until a client sends, request->size is set to the length received
+// and the client id for msgReply is returned
+__attribute__((naked)) int32_t msgReceive(msgBuf *request)
+{
+    __asm("  SVC #37");
+    __asm("  BX LR");
+}
+
+__attribute__((naked)) int32_t msgReply(int32_t client, const void *data, uint32_t size)
+{
+    __asm("  SVC #38");
+    __asm("  BX LR");
+}
+
+// Blocks until every byte is in the pipe, returns the bytes written which is
+// less than size if timeout ticks pass first
+__attribute__((naked)) int32_t pipeWrite(handle p, const void *data, uint32_t size, uint32_t timeout)
+{
+    __asm("  SVC #39");
+    __asm("  BX LR");
+}
+
+// Blocks until the trigger level or size bytes are available, returns the
+// bytes read which may be fewer (even 0) if timeout ticks pass first
+__attribute__((naked)) int32_t pipeRead(handle p, void *data, uint32_t size, uint32_t timeout)
+{
+    __asm("  SVC #40");
+    __asm("  BX LR");
+}
+
+__attribute__((naked)) int32_t pipeSetTrigger(handle p, uint16_t level)
+{
+    __asm("  SVC #41");
+    __asm("  BX LR");
+}
+
+__attribute__((naked)) static int32_t svcSubscribe(handle topic, bool on)
+{
+    __asm("  SVC #45");
+    __asm("  BX LR");
+}
+
+// Only samples published after subscribing are delivered
+int32_t subscribe(handle topic)
+{
+    return svcSubscribe(topic, true);
+}
+
+int32_t unsubscribe(handle topic)
+{
+    return svcSubscribe(topic, false);
+}
+
+// Copies the sample into the pool once and wakes every waiting subscriber
+__attribute__((naked)) int32_t publish(handle topic, const void *data, uint32_t size)
+{
+    __asm("  SVC #42");
+    __asm("  BX LR");
+}
+
+// Blocks until a sample this task has not taken is published, stores its
+// read-only address in *sample and returns its length
+__attribute__((naked)) int32_t topicTake(handle topic, const void **sample, uint32_t timeout)
+{
+    __asm("  SVC #43");
+    __asm("  BX LR");
+}
+
+__attribute__((naked)) int32_t topicRelease(const void *sample)
+{
+    __asm("  SVC #44");
+    __asm("  BX LR");
+}
+
+// Blocks until all parties have arrived, returns BARRIER_LAST to the task
+// that completed the phase and RTOS_OK to the others
+__attribute__((naked)) int32_t barrierWait(handle b)
+{
+    __asm("  SVC #46");
+    __asm("  BX LR");
+}
+
+// Memory from the block or slab heap, mapped into the caller's SRD windows
+// Returns 0 if the heap is full or the task would exceed its quota
+__attribute__((naked)) void *taskMalloc(uint32_t size)
+{
+    __asm("  SVC #51");
+    __asm("  BX LR");
+}
+
+__attribute__((naked)) int32_t taskFree(void *p)
+{
+    __asm("  SVC #52");
+    __asm("  BX LR");
+}
+
+// Called by the idle task to advance the stack high-water scan
+__attribute__((naked)) void scanStacks(void)
+{
+    __asm("  SVC #53");
+    __asm("  BX LR");
+}
+
+__attribute__((naked)) uint32_t getCycles(void)
+{
+    __asm("  SVC #16");
+    __asm("  BX LR");
+}
+
+// Updates the notification value of a task and wakes it if it is waiting
+__attribute__((naked)) int32_t notify(_fn fn, uint32_t bits, uint8_t action)
+{
+    __asm("  SVC #24");
+    __asm("  BX LR");
+}
+
+// Returns the notification value, or 0 if timeout ticks pass without one
+__attribute__((naked)) uint32_t notifyWait(uint32_t clearMask, uint32_t timeout)
+{
+    __asm("  SVC #25");
+    __asm("  BX LR");
+}
+
+// Sleeps while *addr == expected, woken by futexWake or after timeout ticks
+__attribute__((naked)) int32_t futexWait(volatile uint32_t *addr, uint32_t expected, uint32_t timeout)
+{
+    __asm("  SVC #17");
+    __asm("  BX LR");
+}
+
+// Wakes up to count tasks sleeping on addr, returns the number woken
+__attribute__((naked)) int32_t futexWake(volatile uint32_t *addr, uint32_t count)
+{
+    __asm("  SVC #18");
+    __asm("  BX LR");
+}
+
+// REQUIRED: modify this function to add support for the system timer
+// REQUIRED: in preemptive code, add code to request task switch
+void sysTickIsr(void)
+{
+    bool needSwitch = false;
+
+    // CPU time 1 tick = 1 ms of execution time
+    if (tcb[taskCurrent].state == STATE_READY)
+    {
+        // Accumulate runtime for the active task
+        tcb[taskCurrent].runTime++;
+    }
+
+    // Sleep delays
+    int i;
+    for (i = 0; i < MAX_TASKS; i++)
+    {
+        if (tcb[i].state == STATE_DELAYED)
+        {
+            if (tcb[i].ticks > 0)
+            {
+                tcb[i].ticks--;
+                if (tcb[i].ticks == 0)
+                {
+                    tcb[i].state = STATE_READY;
+                    needSwitch = true;
+                }
+            }
+        }
+        else if (tcb[i].state == STATE_BLOCKED_NOTIFY && tcb[i].ticks > 0)
+        {
+            // notifyWait returns 0 when nothing arrived
+            tcb[i].ticks--;
+            if (tcb[i].ticks == 0)
+            {
+                wakeTask(i, 0);
+                needSwitch = true;
+            }
+        }
+        else if (tcb[i].state == STATE_BLOCKED_POLL && tcb[i].ticks > 0)
+        {
+            tcb[i].ticks--;
+            if (tcb[i].ticks == 0)
+            {
+                stopPolling(i);
+                wakeTask(i, RTOS_ERR_TIMEOUT);
+                needSwitch = true;
+            }
+        }
+        else if (tcb[i].state == STATE_BLOCKED_FLAGS && tcb[i].ticks > 0)
+        {
+            // waitFlags returns 0 when the mask was not satisfied
+            tcb[i].ticks--;
+            if (tcb[i].ticks == 0)
+            {
+                wakeTask(i, 0);
+                needSwitch = true;
+            }
+        }
+        else if (tcb[i].state == STATE_BLOCKED_PIPE && tcb[i].ticks > 0)
+        {
+            // Partial transfers are returned rather than an error
+            tcb[i].ticks--;
+            if (tcb[i].ticks == 0)
+            {
+                pipeTimeout(i);
+                needSwitch = true;
+            }
+        }
+        else if (tcb[i].state == STATE_BLOCKED_COND && tcb[i].ticks > 0)
+        {
+            // condWait still reacquires the mutex when it times out
+            tcb[i].ticks--;
+            if (tcb[i].ticks == 0)
+            {
+                requeueOnMutex(i, RTOS_ERR_TIMEOUT);
+                needSwitch = true;
+            }
+        }
+        else if (tcb[i].blockedOn != 0 && tcb[i].ticks > 0)
+        {
+            // Blocking call with a timeout
+            tcb[i].ticks--;
+            if (tcb[i].ticks == 0)
+            {
+                waitQueue *q = tcb[i].blockedOn;
+                wakeTask(i, RTOS_ERR_TIMEOUT);
+                retryRwLock(q);
+                needSwitch = true;
+            }
+        }
+    }
+
+    // Every 2s compute %CPU per task
+    static uint16_t msCounter = 0;
+    msCounter++;
+
+    if (msCounter >= 2000)
+    {
+        msCounter = 0;
+
+        // Sum total time used by all valid tasks
+        uint32_t totalTicks = 0;
+        int i;
+        for (i = 0; i < MAX_TASKS; i++)
+        {
+            if (tcb[i].state != STATE_INVALID && tcb[i].pid != 0)
+                totalTicks += tcb[i].runTime;
+        }
+        if (totalTicks == 0)
+            totalTicks = 1;  // avoid divide-by-zero
+
+        // Compute percentage for each task
+        for (i = 0; i < MAX_TASKS; i++)
+        {
+            if (tcb[i].state != STATE_INVALID && tcb[i].pid != 0)
+            {
+                // Scale by 100
+                tcb[i].cpuPercent = (tcb[i].runTime * 10000UL) / totalTicks;
+                tcb[i].runTime = 0;   // clear for next
+            }
+        }
+    }
+
+    // PendSV only if switch needed
+    if (needSwitch && preemption)
+        NVIC_INT_CTRL_R |= (1 << 28);
+}
+
+
+// REQUIRED: in coop and preemptive, modify this function to add support for task switching
+// REQUIRED: process UNRUN and READY tasks differently
+//void pendSvIsr(void)
+//{
+// left pendsv in faults.c
+//}
+
+
+// Free blocks, then one line per slab cache
+static void printHeap(void)
+{
+    slabStats s;
+    uint8_t cache;
+    uint8_t i;
+    char str[12];
+
+    putsUart0("blocks free: ");
+    itoa(freeBlockCount(), str, 10);
+    putsUart0(str);
+    putcUart0('/');
+    itoa(HEAP_BLOCKS, str, 10);
+    putsUart0(str);
+    putsUart0("\n");
+
+    for (cache = 0; cache < SLAB_CACHES; cache++)
+    {
+        getSlabStats(cache, &s);
+        putsUart0("slab ");
+        itoa(s.objectSize, str, 10);
+        putsUart0(str);
+        putsUart0(": ");
+        itoa(s.slabs, str, 10);
+        putsUart0(str);
+        putsUart0(" slabs, ");
+        itoa(s.used, str, 10);
+        putsUart0(str);
+        putcUart0('/');
+        itoa(s.capacity, str, 10);
+        putsUart0(str);
+        putsUart0(" objects\n");
+    }
+
+    putsUart0("reclaimed: ");
+    itoa(heapReclaimed, str, 10);
+    putsUart0(str);
+    putsUart0(" bytes\n");
+
+    for (i = 0; i < MAX_TASKS; i++)
+    {
+        uint8_t blocks = taskHeapBlockCount(i);
+
+        if (tcb[i].state == STATE_INVALID || blocks == 0)
+            continue;
+        putsUart0(tcb[i].name);
+        putsUart0(": ");
+        itoa(blocks, str, 10);
+        putsUart0(str);
+        putcUart0('/');
+        itoa(tcb[i].heapQuota, str, 10);
+        putsUart0(str);
+        putsUart0(" blocks\n");
+    }
+}
+
+static void printStackLine(const char name[], uint32_t size, uint32_t unused)
+{
+    char str[12];
+
+    putsUart0((char *)name);
+    putPadding(stringLen(name), 15);
+    itoa(size, str, 10);
+    putsUart0(str);
+    putPadding(stringLen(str), 7);
+    itoa(size - unused, str, 10);
+    putsUart0(str);
+    putPadding(stringLen(str), 7);
+    itoa(unused, str, 10);
+    putsUart0(str);
+    putsUart0("\n");
+}
+
+// Size, peak use and headroom in bytes, finishing every scan first
+static void printStacks(void)
+{
+    uint32_t mspSize = (uint32_t)&__STACK_TOP - (uint32_t)&__stack;
+    uint8_t i;
+
+    putsUart0("\nNAME           SIZE   PEAK   FREE\n");
+    putsUart0("-----------------------------------\n");
+    for (i = 0; i < MAX_TASKS; i++)
+    {
+        if (tcb[i].state == STATE_INVALID || tcb[i].stackBase == 0)
+            continue;
+        // The guard subregion is never written and not usable until the
+        // stack has grown past it
+        uint32_t bottom = (uint32_t)tcb[i].stackBase - tcb[i].stackExtra;
+        uint32_t guard = stackLimit(i) - bottom;
+        tcb[i].stackUnused = paintedBytes((const uint32_t *)bottom, tcb[i].stackUnused);
+        printStackLine(tcb[i].name, tcb[i].stackSize + tcb[i].stackExtra - guard,
+                       tcb[i].stackUnused > guard ? tcb[i].stackUnused - guard : 0);
+    }
+    printStackLine("MSP (handler)", mspSize, paintedBytes(&__stack, mspSize));
+}
+
+// Allocation churn shaped like createThread/killThread/restartThread
+// Each round frees a slot and reallocates it with a different stack size,
+// under a pid no task uses so real allocations are never touched
+#define HEAP_BENCH_SLOTS   8
+#define HEAP_BENCH_ROUNDS  64
+#define HEAP_BENCH_PID     0xFE
+
+static void heapBench(void)
+{
+    void *slot[HEAP_BENCH_SLOTS];
+    uint32_t mallocCycles = 0, freeCycles = 0;
+    uint32_t mallocs = 0, frees = 0, failed = 0;
+    uint32_t start;
+    uint16_t round;
+    uint8_t k;
+    char str[12];
+
+    for (k = 0; k < HEAP_BENCH_SLOTS; k++)
+        slot[k] = 0;
+
+    for (round = 0; round < HEAP_BENCH_ROUNDS; round++)
+    {
+        for (k = 0; k < HEAP_BENCH_SLOTS; k++)
+        {
+            if (slot[k] != 0)
+            {
+                start = DWT_CYCCNT_R;
+                free_heap(slot[k], HEAP_BENCH_PID);
+                freeCycles += DWT_CYCCNT_R - start;
+                frees++;
+            }
+
+            start = DWT_CYCCNT_R;
+            slot[k] = malloc_heap(((k + round) % 4 + 1) * 1024, HEAP_BENCH_PID);
+            mallocCycles += DWT_CYCCNT_R - start;
+            mallocs++;
+            if (slot[k] == 0)
+                failed++;
+        }
+    }
+
+    for (k = 0; k < HEAP_BENCH_SLOTS; k++)
+    {
+        if (slot[k] != 0)
+            free_heap(slot[k], HEAP_BENCH_PID);
+    }
+
+    putsUart0("malloc: ");
+    itoa(mallocCycles / mallocs, str, 10);
+    putsUart0(str);
+    putsUart0(" cycles\nfree:   ");
+    itoa(frees > 0 ? freeCycles / frees : 0, str, 10);
+    putsUart0(str);
+    putsUart0(" cycles\nfailed: ");
+    itoa(failed, str, 10);
+    putsUart0(str);
+    putsUart0("\n");
+}
+
+// Called by the MPU fault handler for a data access just below the running
+// task's stack; claims the free blocks down to the fault address so the
+// instruction can be retried
+// The first growth opens the guard subregion, after that the unmapped
+// block below the lowest claimed one acts as the guard, so growth stops
+// above any block the task can already reach (IPC block, taskMalloc)
+bool growStack(uint32_t faultAddr)
+{
+    struct _tcb *t = &tcb[taskCurrent];
+    uint32_t base = (uint32_t)t->stackBase;
+    uint32_t bottom = base - t->stackExtra;
+    uint32_t oldBottom = bottom;
+    uint32_t extra = t->stackExtra;
+    uint32_t block;
+    uint32_t *word;
+
+    if (base == 0 || t->stackGrowMax == 0 || faultAddr >= stackLimit(taskCurrent) ||
+        faultAddr < (uint32_t)HEAP_BASE)
+        return false;
+
+    // Stop at the limit or at the first block that is in use
+    block = faultAddr & ~(BLOCK_SIZE - 1);
+    if (block >= bottom)
+        block = bottom - BLOCK_SIZE;
+    if (bottom - block + extra > t->stackGrowMax)
+        return false;
+    for (bottom -= BLOCK_SIZE; bottom >= block; bottom -= BLOCK_SIZE)
+    {
+        if (isSramAccessAllowed((uint32_t)t->srd, bottom - BLOCK_SIZE, BLOCK_SIZE) ||
+            !claim_heap_block((void *)bottom, (uint16_t)(taskCurrent + 1)))
+            break;
+        t->stackExtra += BLOCK_SIZE;
+    }
+    if (t->stackExtra == extra)
+        return false;
+
+    // Paint the new blocks below the fault, the retried access writes the rest
+    bottom = base - t->stackExtra;
+    for (word = (uint32_t *)bottom; (uint32_t)word < oldBottom && (uint32_t)word < (faultAddr & ~3U); word++)
+        *word = STACK_PAINT;
+    if ((uint32_t)word == oldBottom)
+        t->stackUnused += oldBottom - bottom;
+    else
+        t->stackUnused = (uint32_t)word - bottom;
+    if (scanTask == taskCurrent)
+        scanOffset = 0;
+
+    updateTaskSramMask(taskCurrent);
+    applySramAccessMask(t->srd);
+    setupStackRegion(base, t->stackSize, false);
+    return stackLimit(taskCurrent) <= faultAddr;
+}
+
+// Releases everything the task holds and marks it killed, also used by the
+// MPU fault handler on a stack overflow
+uint32_t killTask(uint8_t task)
+{
+    uint32_t bytes = 0;
+
+    // Remove from any wait queue, the owner may lose inherited priority
+    leaveBarrier(task);
+    if (tcb[task].blockedOn != 0)
+        unlinkWaiter(task);
+    if (tcb[task].state == STATE_BLOCKED_MUTEX)
+    {
+        uint8_t owner = mutexOwner(tcb[task].waitingMutex);
+        if (owner < MAX_TASKS)
+            updateInheritedPriority(owner);
+    }
+    tcb[task].waitingMutex = NO_OBJECT;
+    tcb[task].resultPending = false;
+
+    releaseHeldMutexes(task);
+    releaseRwLocks(task);
+    stopPolling(task);
+    abortMessages(task);
+    releaseTopics(task);
+
+    // Free everything the thread owns, its own stack is still in use
+    if (task != taskCurrent)
+        bytes = reclaimTaskMemory(task, false);
+    else
+        reclaimPending |= 1U << task;
+
+    // Mark TCB as killed
+    tcb[task].state      = STATE_KILLED;
+    tcb[task].sp         = 0;
+    tcb[task].ticks      = 0;
+    tcb[task].runTime    = 0;
+    tcb[task].cpuPercent = 0;
+
+    // If killed the running task reschedule
+    if (task == taskCurrent)
+    {
+        NVIC_INT_CTRL_R |= (1 << 28);
+    }
+    return bytes;
+}
+
+// REQUIRED: modify this function to add support for the service call
+// REQUIRED: in preemptive code, add code to handle synchronization primitives
+void svCallIsr(void)
+{
+    uint32_t *psp;
+    uint16_t *pc;
+    uint8_t svc_number;
+
+    psp = (uint32_t *)getPsp();
+
+    pc = (uint16_t *)(psp[6] - 2);
+
+    svc_number = ((uint8_t *)pc)[0];
+
+    //Handle SVC
+    switch (svc_number)
+    {
+        int i;
+        case 0: // YIELD
+            NVIC_INT_CTRL_R |= (1<<28);
+            break;
+
+        case 1: // SLEEP
+        {
+            uint32_t sleep_time = psp[0];
+
+            // Mark task as delayed
+            tcb[taskCurrent].ticks = sleep_time;
+            tcb[taskCurrent].state = STATE_DELAYED;
+
+            // Trigger context switch when going to sleep
+            NVIC_INT_CTRL_R |= (1 << 28);
+            break;
+        }
+        case 2: // LOCK MUTEX
+        {
+            uint8_t slot = objectSlot((handle)psp[0], OBJ_MUTEX);
+            if (slot == MAX_OBJECTS)
+            {
+                psp[0] = (uint32_t)RTOS_ERR_INVALID;
+                break;
+            }
+
+            volatile uint32_t *word = &IPC_SHARED->word[slot];
+            uint8_t owner = mutexOwner(slot);
+            psp[0] = RTOS_OK;
+
+            // The fast path left an owner that is no live task
+            if (!mutexOwnerValid(slot))
+                psp[0] = (uint32_t)RTOS_ERR_INVALID;
+            else if (owner == 0xFF)
+            {
+                // Mutex was released before the trap completed
+                *word = (*word & MUTEX_RECURSIVE) | MUTEX_COUNT_ONE | (taskCurrent + 1);
+                attachHeldMutex(taskCurrent, slot);
+                statAcquired(slot);
+            }
+            else if (owner == taskCurrent)
+            {
+                // Relocking a plain mutex would never return
+                if (!(*word & MUTEX_RECURSIVE))
+                    psp[0] = (uint32_t)RTOS_ERR_DEADLOCK;
+                else if ((*word & MUTEX_COUNT_M) == MUTEX_COUNT_M)
+                    psp[0] = (uint32_t)RTOS_ERR_AGAIN;
+                else
+                    *word += MUTEX_COUNT_ONE;
+            }
+            else if (deadlockPolicy != DEADLOCK_OFF && closesCycle(taskCurrent, owner))
+            {
+                uint32_t savedMask = tcb[taskCurrent].srd;
+                applySramAccessMask(0x00000000);
+                printCycle(taskCurrent, slot);
+                applySramAccessMask(savedMask);
+
+                if (deadlockPolicy == DEADLOCK_ABORT)
+                    psp[0] = (uint32_t)RTOS_ERR_DEADLOCK;
+            }
+
+            if (owner != 0xFF && owner != taskCurrent && psp[0] == RTOS_OK)
+            {
+                // Already locked block current task, owner must trap on unlock
+                *word |= MUTEX_WAITERS;
+                if (objects[slot].u.mtx.heldBy != owner)
+                    attachHeldMutex(owner, slot);
+
+                tcb[taskCurrent].waitingMutex = slot;
+                tcb[taskCurrent].waitResult   = RTOS_OK;
+                statBlocked(slot, taskCurrent);
+                blockOn(&objects[slot].u.mtx.waiters, STATE_BLOCKED_MUTEX, WAIT_FOREVER);
+
+                if (priorityInheritance)
+                    inheritPriority(owner, tcb[taskCurrent].currentPriority);
+            }
+            break;
+        }
+        case 3: // UNLOCK MUTEX
+        {
+            uint8_t slot = objectSlot((handle)psp[0], OBJ_MUTEX);
+
+            // Only the owner may unlock
+            if (slot == MAX_OBJECTS || mutexOwner(slot) != taskCurrent)
+            {
+                psp[0] = (uint32_t)RTOS_ERR_INVALID;
+                break;
+            }
+
+            if ((IPC_SHARED->word[slot] & MUTEX_COUNT_M) > MUTEX_COUNT_ONE)
+                IPC_SHARED->word[slot] -= MUTEX_COUNT_ONE;
+            else
+                releaseMutex(slot);
+            psp[0] = RTOS_OK;
+            break;
+        }
+        case 4: // WAIT
+        {
+            uint8_t slot = objectSlot((handle)psp[0], OBJ_SEMAPHORE);
+            if (slot == MAX_OBJECTS)
+            {
+                psp[0] = (uint32_t)RTOS_ERR_INVALID;
+                break;
+            }
+
+            volatile uint32_t *word = &IPC_SHARED->word[slot];
+            psp[0] = RTOS_OK;
+
+            if ((*word & SEM_COUNT_M) > 0)
+            {
+                // Token posted before the trap completed
+                (*word)--;
+                statAcquired(slot);
+                break;
+            }
+
+            // No tokens block this task, posters must trap to wake it
+            *word |= SEM_WAITERS;
+            tcb[taskCurrent].waitingSemaphore = slot;
+            statBlocked(slot, taskCurrent);
+            blockOn(&objects[slot].u.sem.waiters, STATE_BLOCKED_SEMAPHORE, WAIT_FOREVER);
+            break;
+        }
+        case 5: // POST
+        {
+            uint8_t slot = objectSlot((handle)psp[0], OBJ_SEMAPHORE);
+            if (slot == MAX_OBJECTS)
+            {
+                psp[0] = (uint32_t)RTOS_ERR_INVALID;
+                break;
+            }
+
+            waitQueue *q = &objects[slot].u.sem.waiters;
+            volatile uint32_t *word = &IPC_SHARED->word[slot];
+            psp[0] = RTOS_OK;
+
+            if (q->head != NO_TASK)
+            {
+                // Hand the token straight to the best waiter
+                statWaited(slot, q->head);
+                wakeTask(q->head, RTOS_OK);
+                if (q->head == NO_TASK && objects[slot].pollers == 0)
+                    *word &= ~SEM_WAITERS;
+
+                // context switch when a waiter exists
+                NVIC_INT_CTRL_R |= (1 << 28);
+            }
+            else if ((*word & SEM_COUNT_M) < SEM_COUNT_M)
+            {
+                // Give back a token
+                *word = (*word & SEM_COUNT_M) + 1;
+                wakePollers(slot);
+            }
+            else
+                psp[0] = (uint32_t)RTOS_ERR_AGAIN;
+            break;
+        }
+        case 6: // PIDOF
+        {
+            int i;
+            char *target = (char *)psp[0];  //name string pointer in R0
+            for (i = 0; i < MAX_TASKS; i++)
+            {
+                if (tcb[i].pid != 0 && tcb[i].state != STATE_INVALID)
+                {
+                    char *a = (char*)tcb[i].name;
+                    char *b = target;
+                    bool match = true;
+                    while (*a && *b)
+                    {
+                        if (*a != *b)
+                        {
+                            match = false;
+                            break;
+                        }
+                        a++; b++;
+                    }
+                    if (match && *a == '\0' && *b == '\0')
+                    {
+                        psp[0] = (uint32_t)tcb[i].pid;
+                        return;
+                    }
+                }
+            }
+            psp[0] = 0;
+            break;
+        }
+        case 7: // REBOOT
+        {
+            // Request system reset
+            NVIC_APINT_R = 0x05FA0004;
+
+            break;
+        }
+        case 8: // killThread
+        {
+            _fn fn = (_fn)psp[0];
+
+            psp[0] = 0;
+            if (fn != 0)
+            {
+                int i;
+                int idx = -1;
+
+                // Find the TCB for thread
+                for (i = 0; i < MAX_TASKS; i++)
+                {
+                    if (tcb[i].pid == fn && tcb[i].state != STATE_INVALID)
+                    {
+                        idx = i;
+                        break;
+                    }
+                }
+
+                if (idx >= 0)
+                    psp[0] = killTask(idx);
+            }
+            break;
+        }
+        case 9: // restartThread
+        {
+            _fn fn = (_fn)psp[0];
+
+            if (fn != 0)
+            {
+                uint32_t savedMask = tcb[taskCurrent].srd;
+                applySramAccessMask(0x00000000);
+
+                int i;
+                int idx = -1;
+
+                // Find TCB for this function
+                for (i = 0; i < MAX_TASKS; i++)
+                {
+                    if (tcb[i].pid == fn && tcb[i].state != STATE_INVALID)
+                    {
+                        idx = i;
+                        break;
+                    }
+                }
+
+                if (idx >= 0)
+                {
+                    leaveBarrier(idx);
+                    if (tcb[idx].blockedOn != 0)
+                        unlinkWaiter(idx);
+                    if (tcb[idx].state == STATE_BLOCKED_MUTEX)
+                    {
+                        uint8_t owner = mutexOwner(tcb[idx].waitingMutex);
+                        if (owner < MAX_TASKS)
+                            updateInheritedPriority(owner);
+                    }
+                    tcb[idx].waitingMutex = NO_OBJECT;
+                    tcb[idx].resultPending = false;
+                    releaseHeldMutexes(idx);
+                    releaseRwLocks(idx);
+                    stopPolling(idx);
+                    abortMessages(idx);
+                    releaseTopics(idx);
+
+                    // Everything but the stack goes back to the heap, the stack
+                    // is reused in place so a live task always restarts
+                    uint8_t *stackBase = (uint8_t *)tcb[idx].stackBase;
+                    reclaimTaskMemory(idx, stackBase != 0);
+
+                    // Only a killed task has lost its stack
+                    uint32_t stackBytes = tcb[idx].stackSize;
+                    if (stackBytes == 0)
+                        stackBytes = 1024;  // fallback
+                    if (stackBase == 0)
+                        stackBase = (uint8_t *)malloc_heap_region(stackBytes, (uint16_t)(idx + 1));
+
+                    if (stackBase != 0)
+                    {
+                        uint8_t *stackTop = stackBase + stackBytes;
+                        // 8-byte align
+                        stackTop = (uint8_t *)(((uint32_t)stackTop) & 0xFFFFFFF8);
+
+                        tcb[idx].stackBase = stackBase;
+                        tcb[idx].sp        = (void *)stackTop;
+
+                        // Rebuild MPU SRD mask, the stack itself is region 4
+                        updateTaskSramMask(idx);
+                        paintStack(idx);
+
+                        // Reset runtime fields and state
+                        tcb[idx].ticks       = 0;
+                        tcb[idx].runTime     = 0;
+                        tcb[idx].cpuPercent  = 0;
+                        tcb[idx].notifyValue   = 0;
+                        tcb[idx].notifyPending = false;
+                        tcb[idx].state       = STATE_UNRUN;
+
+                        // A task restarting itself starts over at the next switch
+                        if (idx == taskCurrent)
+                            NVIC_INT_CTRL_R |= (1 << 28);
+                    }
+                    // else: killed task and no room for a new stack
+                }
+
+                // Restore original mask
+                applySramAccessMask(savedMask);
+            }
+            break;
+        }
+        case 10: // setThreadPriority
+        {
+            _fn fn = (_fn)psp[0];      // R0 = function pointer
+            uint8_t prio = (uint8_t)psp[1];  // R1 = priority
+
+            if (fn != 0)
+            {
+                uint32_t savedMask = tcb[taskCurrent].srd;
+                applySramAccessMask(0x00000000);
+
+                // Clamp to valid range
+                if (prio >= NUM_PRIORITIES)
+                    prio = NUM_PRIORITIES - 1;
+
+                int i;
+                for (i = 0; i < MAX_TASKS; i++)
+                {
+                    if (tcb[i].pid == fn &&
+                        tcb[i].state != STATE_INVALID &&
+                        tcb[i].state != STATE_KILLED)
+                    {
+                        tcb[i].priority = prio;
+                        updateInheritedPriority(i);
+                        if (tcb[i].state == STATE_BLOCKED_MUTEX && priorityInheritance)
+                            inheritPriority(mutexOwner(tcb[i].waitingMutex), tcb[i].currentPriority);
+                        break;
+                    }
+                }
+
+                applySramAccessMask(savedMask);
+
+                // Let scheduler consider if needed
+                if (priorityScheduler && preemption)
+                    NVIC_INT_CTRL_R |= (1 << 28);
+            }
+            break;
+        }
+        case 11: // ps()
+        {
+            uint32_t savedMask = tcb[taskCurrent].srd;
+            applySramAccessMask(0x00000000);
+
+            putsUart0("\nNAME            STATE     PRIO  %CPU\n");
+            putsUart0("--------------------------------------\n");
+
+            int i, j;
+            char str[12];
+
+            for (i = 0; i < MAX_TASKS; i++)
+            {
+                if (tcb[i].state != STATE_INVALID && tcb[i].pid != 0)
+                {
+                    // Name
+                    putsUart0(tcb[i].name);
+                    for (j = stringLen(tcb[i].name); j < 15; j++)
+                        putcUart0(' ');
+
+                    // State
+                    switch (tcb[i].state)
+                    {
+                        case STATE_UNRUN:             putsUart0("UNRUN   "); break;
+                        case STATE_READY:             putsUart0("READY   "); break;
+                        case STATE_DELAYED:           putsUart0("DELAYED "); break;
+                        case STATE_BLOCKED_SEMAPHORE: putsUart0("SEM_BLK "); break;
+                        case STATE_BLOCKED_MUTEX:     putsUart0("MTX_BLK "); break;
+                        case STATE_KILLED:            putsUart0("KILLED  "); break;
+                        case STATE_BLOCKED_FUTEX:     putsUart0("FTX_BLK "); break;
+                        case STATE_BLOCKED_QUEUE:     putsUart0("Q_BLK   "); break;
+                        case STATE_BLOCKED_NOTIFY:    putsUart0("NTF_BLK "); break;
+                        case STATE_BLOCKED_RWLOCK:    putsUart0("RW_BLK  "); break;
+                        case STATE_BLOCKED_COND:      putsUart0("CV_BLK  "); break;
+                        case STATE_BLOCKED_POLL:      putsUart0("POLL_BLK"); break;
+                        case STATE_BLOCKED_FLAGS:     putsUart0("FLG_BLK "); break;
+                        case STATE_SEND_BLOCKED:      putsUart0("SND_BLK "); break;
+                        case STATE_REPLY_BLOCKED:     putsUart0("RPL_BLK "); break;
+                        case STATE_RECEIVE_BLOCKED:   putsUart0("RCV_BLK "); break;
+                        case STATE_BLOCKED_PIPE:      putsUart0("PIPE_BLK"); break;
+                        case STATE_BLOCKED_TOPIC:     putsUart0("TOP_BLK "); break;
+                        case STATE_BLOCKED_BARRIER:   putsUart0("BAR_BLK "); break;
+                        default:                      putsUart0("INVLD   "); break;
+                    }
+
+                    // Priority
+                    itoa(tcb[i].priority, str, 10);
+                    putsUart0(str);
+                    putsUart0("   ");
+
+                    // %CPU
+                    uint32_t pct   = tcb[i].cpuPercent;  // scaled 100
+                    uint32_t whole = pct / 100;
+                    uint32_t frac  = pct % 100;
+
+                    char wbuf[8], fbuf[4];
+                    itoa(whole, wbuf, 10);
+                    itoa(frac,  fbuf, 10);
+
+                    putsUart0(wbuf);
+                    putcUart0('.');
+                    if (frac < 10) putcUart0('0');
+                    putsUart0(fbuf);
+                    putsUart0("\n");
+                }
+            }
+
+            applySramAccessMask(savedMask);
+            break;
+        }
+        case 12: // ipcs()
+        {
+            uint32_t savedMask = tcb[taskCurrent].srd;
+            applySramAccessMask(0x00000000);
+
+            if (psp[0] == IPCS_WAIT_FOR)
+            {
+                printWaitFor();
+                applySramAccessMask(savedMask);
+                break;
+            }
+            if (psp[0] == IPCS_RESET)
+            {
+                resetStats();
+                putsUart0("lock stats reset\n");
+                applySramAccessMask(savedMask);
+                break;
+            }
+
+            putsUart0("\nIPC TYPE  ID    NAME        STATE/INFO\n");
+            putsUart0("------------------------------------------------------\n");
+
+            char str[12];
+            int i;
+
+            for (i = 0; i < MAX_OBJECTS; i++)
+            {
+                kobject *obj = &objects[i];
+                if (obj->type == OBJ_FREE)
+                    continue;
+
+                switch (obj->type)
+                {
+                    case OBJ_SEMAPHORE: putsUart0("SEM      "); break;
+                    case OBJ_MUTEX:     putsUart0("MUTEX    "); break;
+                    case OBJ_QUEUE:     putsUart0("QUEUE    "); break;
+                    case OBJ_RWLOCK:    putsUart0("RWLOCK   "); break;
+                    case OBJ_CONDVAR:   putsUart0("CONDVAR  "); break;
+                    case OBJ_FLAGS:     putsUart0("FLAGS    "); break;
+                    case OBJ_PIPE:      putsUart0("PIPE     "); break;
+                    case OBJ_TOPIC:     putsUart0("TOPIC    "); break;
+                    case OBJ_BARRIER:   putsUart0("BARRIER  "); break;
+                }
+
+                // Handle
+                itoa(((handle)obj->generation << 8) | i, str, 16);
+                putsUart0(str);
+                putPadding(stringLen(str), 6);
+
+                putsUart0(obj->name);
+                putPadding(stringLen(obj->name), 12);
+
+                if (obj->type == OBJ_SEMAPHORE)
+                {
+                    putsUart0("count=");
+                    itoa(IPC_SHARED->word[i] & SEM_COUNT_M, str, 10);
+                    putsUart0(str);
+                    printWaiters("  waiting=", &obj->u.sem.waiters);
+                }
+                else if (obj->type == OBJ_MUTEX)
+                {
+                    uint8_t owner = mutexOwner(i);
+                    putsUart0("locked=");
+                    itoa((IPC_SHARED->word[i] & MUTEX_COUNT_M) / MUTEX_COUNT_ONE, str, 10);
+                    putsUart0(str);
+                    if (IPC_SHARED->word[i] & MUTEX_RECURSIVE)
+                        putsUart0("R");
+
+                    putsUart0("  by=");
+                    if (owner < MAX_TASKS)
+                        putsUart0(tcb[owner].name);
+                    else
+                        putsUart0("---");
+                    printWaiters("  waiting=", &obj->u.mtx.waiters);
+                }
+                else if (obj->type == OBJ_QUEUE)
+                {
+                    putsUart0("items=");
+                    itoa(obj->u.q.count, str, 10);
+                    putsUart0(str);
+                    putcUart0('/');
+                    itoa(obj->u.q.depth, str, 10);
+                    putsUart0(str);
+                    printWaiters("  readers=", &obj->u.q.readers);
+                    printWaiters("  writers=", &obj->u.q.writers);
+                }
+                else if (obj->type == OBJ_RWLOCK)
+                {
+                    rwlock *rw = &obj->u.rw;
+                    uint8_t task;
+
+                    putsUart0("readers=");
+                    itoa(rw->readCount, str, 10);
+                    putsUart0(str);
+                    for (task = 0; task < MAX_TASKS; task++)
+                    {
+                        if (rw->readHolders & (1 << task))
+                        {
+                            putcUart0(' ');
+                            putsUart0(tcb[task].name);
+                        }
+                    }
+
+                    putsUart0("  writer=");
+                    putsUart0(rw->writer != NO_TASK ? tcb[rw->writer].name : "---");
+                    printWaiters("  rd_wait=", &rw->readers);
+                    printWaiters("  wr_wait=", &rw->writers);
+                }
+                else if (obj->type == OBJ_CONDVAR)
+                {
+                    printWaiters("waiting=", &obj->u.cv.waiters);
+                }
+                else if (obj->type == OBJ_FLAGS)
+                {
+                    putsUart0("bits=");
+                    itoa(obj->u.flags.bits, str, 16);
+                    putsUart0(str);
+                    printWaiters("  waiting=", &obj->u.flags.waiters);
+                }
+                else if (obj->type == OBJ_PIPE)
+                {
+                    putsUart0("bytes=");
+                    itoa(obj->u.p.count, str, 10);
+                    putsUart0(str);
+                    putcUart0('/');
+                    itoa(obj->u.p.size, str, 10);
+                    putsUart0(str);
+                    putsUart0("  trigger=");
+                    itoa(obj->u.p.trigger, str, 10);
+                    putsUart0(str);
+                    printWaiters("  readers=", &obj->u.p.readers);
+                    printWaiters("  writers=", &obj->u.p.writers);
+                }
+                else if (obj->type == OBJ_TOPIC)
+                {
+                    uint8_t task, subscribers = 0;
+                    for (task = 0; task < MAX_TASKS; task++)
+                        subscribers += (obj->u.t.subscribers >> task) & 1;
+
+                    putsUart0("subs=");
+                    itoa(subscribers, str, 10);
+                    putsUart0(str);
+                    putsUart0("  latest=");
+                    if (obj->u.t.latest != NO_SAMPLE)
+                    {
+                        itoa(sampleLength[obj->u.t.latest], str, 10);
+                        putsUart0(str);
+                        putsUart0("B refs=");
+                        itoa(sampleRefs[obj->u.t.latest], str, 10);
+                        putsUart0(str);
+                    }
+                    else
+                        putsUart0("---");
+                    printWaiters("  waiting=", &obj->u.t.waiters);
+                }
+                else if (obj->type == OBJ_BARRIER)
+                {
+                    putsUart0("arrived=");
+                    itoa(obj->u.b.arrived, str, 10);
+                    putsUart0(str);
+                    putcUart0('/');
+                    itoa(obj->u.b.parties, str, 10);
+                    putsUart0(str);
+                    putsUart0("  phase=");
+                    itoa(obj->u.b.phase, str, 10);
+                    putsUart0(str);
+                    printWaiters("  waiting=", &obj->u.b.waiters);
+                }
+                putsUart0("\n");
+
+                if (obj->type == OBJ_SEMAPHORE || obj->type == OBJ_MUTEX)
+                    printLockStats(&stats[i], obj->type == OBJ_MUTEX);
+            }
+
+            applySramAccessMask(savedMask);
+            break;
+        }
+        case 13: // PI
+        {
+            bool on = (bool)psp[0];  // R0
+
+            uint32_t savedMask = tcb[taskCurrent].srd;
+            applySramAccessMask(0x00000000);
+
+            priorityInheritance = on;
+            putsUart0(on ? "pi on\n" : "pi off\n");
+
+            applySramAccessMask(savedMask);
+            break;
+        }
+
+        case 14: // PREEMPT
+        {
+            bool on = (bool)psp[0];
+
+            uint32_t savedMask = tcb[taskCurrent].srd;
+            applySramAccessMask(0x00000000);
+
+            preemption = on;
+            putsUart0(on ? "preempt on\n" : "preempt off\n");
+
+            applySramAccessMask(savedMask);
             break;
+        }
 
-        case 1: // SLEEP
+        case 15: // SCHED
         {
-            uint32_t sleep_time = psp[0];
+            bool prio_on = (bool)psp[0];
 
-            // Mark task as delayed
-            tcb[taskCurrent].ticks = sleep_time;
-            tcb[taskCurrent].state = STATE_DELAYED;
+            uint32_t savedMask = tcb[taskCurrent].srd;
+            applySramAccessMask(0x00000000);
 
-            // Trigger context switch when going to sleep
-            NVIC_INT_CTRL_R |= (1 << 28);
+            priorityScheduler = prio_on;
+            putsUart0(prio_on ? "sched prio\n" : "sched rr\n");
+
+            applySramAccessMask(savedMask);
             break;
         }
-        case 2: // LOCK MUTEX
+        case 16: // CYCLES
         {
-            int8_t m = (int8_t)psp[0];      // R0 = mutex index
-            if (m < 0 || m >= MAX_MUTEXES)
-                break;                      // ignore invalid index
-
-            mutex *mtx = &mutexes[m];
-
-            if (!mtx->lock)
+            psp[0] = DWT_CYCCNT_R;
+            break;
+        }
+        case 17: // FUTEX WAIT
+        {
+            uint32_t addr     = psp[0];
+            uint32_t expected = psp[1];
+            uint32_t timeout  = psp[2];
+
+            // Word must be aligned and writable by the caller
+            if ((addr & 3) != 0 || !isWritableByTask(taskCurrent, addr, sizeof(uint32_t)))
+                psp[0] = (uint32_t)RTOS_ERR_INVALID;
+            else if (*(volatile uint32_t *)addr != expected)
+                psp[0] = (uint32_t)RTOS_ERR_AGAIN;
+            else
             {
-                // Mutex is free
-                mtx->lock = true;
-                mtx->lockedBy = taskCurrent;
-                tcb[taskCurrent].mutex = m;
+                tcb[taskCurrent].futexAddr = addr;
+                blockOn(&futexTable[futexHash(addr)], STATE_BLOCKED_FUTEX, timeout);
             }
-            else
+            break;
+        }
+        case 18: // FUTEX WAKE
+        {
+            uint32_t addr  = psp[0];
+            uint32_t count = psp[1];
+            uint32_t woken = 0;
+
+            if ((addr & 3) != 0 || !isWritableByTask(taskCurrent, addr, sizeof(uint32_t)))
             {
-                // Already locked block current task
-                tcb[taskCurrent].state = STATE_BLOCKED_MUTEX;
+                psp[0] = (uint32_t)RTOS_ERR_INVALID;
+                break;
+            }
 
-                if (mtx->queueSize < MAX_MUTEX_QUEUE_SIZE)
-                    mtx->processQueue[mtx->queueSize++] = taskCurrent;
+            // Bucket is in priority order so the best waiters go first
+            uint8_t task = futexTable[futexHash(addr)].head;
+            while (task != NO_TASK && woken < count)
+            {
+                uint8_t next = tcb[task].nextWaiter;
+                if (tcb[task].futexAddr == addr)
+                {
+                    wakeTask(task, RTOS_OK);
+                    woken++;
+                }
+                task = next;
+            }
 
-                // Context switch to another ready task
+            psp[0] = woken;
+            if (woken > 0)
                 NVIC_INT_CTRL_R |= (1 << 28);
+            break;
+        }
+        case 19: // CREATE OBJECT
+        {
+            uint8_t type = (uint8_t)psp[0];
+            uint32_t param = psp[1];
+            const char *name = (const char *)psp[2];
+
+            if (name != 0 && !isReadableByTask(taskCurrent, (uint32_t)name, OBJECT_NAME_SIZE))
+                psp[0] = INVALID_HANDLE;
+            else
+                psp[0] = allocObject(type, param, name);
+            break;
+        }
+        case 20: // DELETE OBJECT
+        {
+            handle h = (handle)psp[0];
+            uint8_t slot = HANDLE_SLOT(h);
+
+            if (slot >= MAX_OBJECTS || objects[slot].type == OBJ_FREE ||
+                objects[slot].generation != HANDLE_GENERATION(h))
+                psp[0] = (uint32_t)RTOS_ERR_INVALID;
+            else
+            {
+                freeObject(slot);
+                psp[0] = RTOS_OK;
             }
             break;
         }
-        case 3: // UNLOCK MUTEX
+        case 21: // FIND OBJECT
         {
-            int8_t m = (int8_t)psp[0];
-            if (m < 0 || m >= MAX_MUTEXES)
-                break;
+            const char *name = (const char *)psp[0];
+            psp[0] = INVALID_HANDLE;
 
-            mutex *mtx = &mutexes[m];
+            if (name == 0 || !isReadableByTask(taskCurrent, (uint32_t)name, OBJECT_NAME_SIZE))
+                break;
 
-            // Only the owner may unlock
-            if (mtx->lock && mtx->lockedBy == taskCurrent)
+            for (i = 0; i < MAX_OBJECTS; i++)
             {
-                if (mtx->queueSize > 0)
-                {
-                    // Wake up the first waiting task
-                    uint8_t next = mtx->processQueue[0];
-
-                    // Shift queue forward
-                    for (i = 1; i < mtx->queueSize; i++)
-                        mtx->processQueue[i - 1] = mtx->processQueue[i];
-                    mtx->queueSize--;
-
-                    // Transfer ownership
-                    mtx->lockedBy = next;
-                    tcb[next].mutex = m;
-                    tcb[next].state = STATE_READY;
-                }
-                else
+                if (objects[i].type != OBJ_FREE && namesMatch(objects[i].name, name))
                 {
-                    // Nobody waiting unlock
-                    mtx->lock = false;
-                    mtx->lockedBy = 0xFF;
+                    psp[0] = ((handle)objects[i].generation << 8) | i;
+                    break;
                 }
+            }
+            break;
+        }
+        case 22: // QUEUE SEND
+        {
+            uint8_t slot = objectSlot((handle)psp[0], OBJ_QUEUE);
+            uint32_t message = psp[1];
+            uint32_t timeout = psp[2];
+
+            if (slot == MAX_OBJECTS)
+            {
+                psp[0] = (uint32_t)RTOS_ERR_INVALID;
+                break;
+            }
 
-                tcb[taskCurrent].mutex = 0xFF;  // Clear current tasks mutex
+            queue *q = &objects[slot].u.q;
+            psp[0] = RTOS_OK;
 
-                // Give scheduler a chance to run the unblocked task
+            if (q->readers.head != NO_TASK)
+            {
+                // Give the message straight to the best reader
+                uint8_t reader = q->readers.head;
+                *tcb[reader].messagePtr = message;
+                wakeTask(reader, RTOS_OK);
                 NVIC_INT_CTRL_R |= (1 << 28);
             }
+            else if (q->count < q->depth)
+            {
+                q->items[(q->head + q->count) % q->depth] = message;
+                q->count++;
+                wakePollers(slot);
+            }
+            else
+            {
+                tcb[taskCurrent].message = message;
+                blockOn(&q->writers, STATE_BLOCKED_QUEUE, timeout);
+            }
             break;
         }
-        case 4: // WAIT
+        case 23: // QUEUE RECEIVE
         {
-            int8_t s = (int8_t)psp[0];
-            if (s < 0 || s >= MAX_SEMAPHORES)
-                break;
+            uint8_t slot = objectSlot((handle)psp[0], OBJ_QUEUE);
+            uint32_t *message = (uint32_t *)psp[1];
+            uint32_t timeout = psp[2];
 
-            semaphore *sem = &semaphores[s];
-
-            if (sem->count > 0)
+            if (slot == MAX_OBJECTS ||
+                !isWritableByTask(taskCurrent, (uint32_t)message, sizeof(uint32_t)))
             {
-                // Token available
-                sem->count--;
-                return;
+                psp[0] = (uint32_t)RTOS_ERR_INVALID;
+                break;
             }
 
-            // No tokens block this task
-            tcb[taskCurrent].state     = STATE_BLOCKED_SEMAPHORE;
-            tcb[taskCurrent].semaphore = s;
+            queue *q = &objects[slot].u.q;
+            psp[0] = RTOS_OK;
 
-            if (sem->queueSize < MAX_SEMAPHORE_QUEUE_SIZE)
-                sem->processQueue[sem->queueSize++] = taskCurrent;
+            if (q->count > 0)
+            {
+                *message = q->items[q->head];
+                q->head = (q->head + 1) % q->depth;
+                q->count--;
 
-            // Switch to another task
-            NVIC_INT_CTRL_R |= (1 << 28);
+                // Room for the best blocked writer
+                if (q->writers.head != NO_TASK)
+                {
+                    uint8_t writer = q->writers.head;
+                    q->items[(q->head + q->count) % q->depth] = tcb[writer].message;
+                    q->count++;
+                    wakeTask(writer, RTOS_OK);
+                    NVIC_INT_CTRL_R |= (1 << 28);
+                }
+            }
+            else
+            {
+                tcb[taskCurrent].messagePtr = message;
+                blockOn(&q->readers, STATE_BLOCKED_QUEUE, timeout);
+            }
             break;
         }
-        case 5: // POST
+        case 24: // NOTIFY
         {
-            int8_t s = (int8_t)psp[0];
-            if (s < 0 || s >= MAX_SEMAPHORES)
-                break;
-
-            semaphore *sem = &semaphores[s];
+            _fn fn = (_fn)psp[0];
+            uint32_t bits = psp[1];
+            uint8_t action = (uint8_t)psp[2];
+            uint8_t idx = 0;
 
-            // Give back a token
-            sem->count++;
+            while (idx < MAX_TASKS &&
+                   (tcb[idx].pid != fn || tcb[idx].state == STATE_INVALID || tcb[idx].state == STATE_KILLED))
+                idx++;
 
-            if (sem->queueSize > 0)
+            if (fn == 0 || idx == MAX_TASKS || action > NOTIFY_OVERWRITE)
             {
-                // Wake first waiter
-                uint8_t next = sem->processQueue[0];
+                psp[0] = (uint32_t)RTOS_ERR_INVALID;
+                break;
+            }
 
-                // Shift queue
-                int i;
-                for (i = 1; i < sem->queueSize; i++)
-                    sem->processQueue[i-1] = sem->processQueue[i];
-                sem->queueSize--;
+            uint32_t next;
+            if (action == NOTIFY_SET_BITS)
+                next = tcb[idx].notifyValue | bits;
+            else if (action == NOTIFY_INCREMENT)
+                next = tcb[idx].notifyValue + 1;
+            else
+                next = bits;
+
+            // 0 is reserved for the notifyWait timeout
+            if (next == 0)
+            {
+                psp[0] = (uint32_t)RTOS_ERR_INVALID;
+                break;
+            }
 
-                // Give token to that task
-                sem->count--;
-                tcb[next].state     = STATE_READY;
-                tcb[next].semaphore = 0xFF;
+            tcb[idx].notifyValue = next;
+            tcb[idx].notifyPending = true;
 
-                // context switch when a waiter exists
+            if (tcb[idx].state == STATE_BLOCKED_NOTIFY)
+            {
+                uint32_t value = tcb[idx].notifyValue;
+                tcb[idx].notifyValue &= ~tcb[idx].notifyClearMask;
+                tcb[idx].notifyPending = false;
+                wakeTask(idx, (int32_t)value);
                 NVIC_INT_CTRL_R |= (1 << 28);
             }
-
+            psp[0] = RTOS_OK;
             break;
         }
-        case 6: // PIDOF
+        case 25: // NOTIFY WAIT
         {
-            int i;
-            char *target = (char *)psp[0];  //name string pointer in R0
-            for (i = 0; i < MAX_TASKS; i++)
+            uint32_t clearMask = psp[0];
+            uint32_t timeout = psp[1];
+
+            if (tcb[taskCurrent].notifyPending)
             {
-                if (tcb[i].pid != 0 && tcb[i].state != STATE_INVALID)
-                {
-                    char *a = (char*)tcb[i].name;
-                    char *b = target;
-                    bool match = true;
-                    while (*a && *b)
-                    {
-                        if (*a != *b)
-                        {
-                            match = false;
-                            break;
-                        }
-                        a++; b++;
-                    }
-                    if (match && *a == '\0' && *b == '\0')
-                    {
-                        psp[0] = (uint32_t)tcb[i].pid;
-                        return;
-                    }
-                }
+                psp[0] = tcb[taskCurrent].notifyValue;
+                tcb[taskCurrent].notifyValue &= ~clearMask;
+                tcb[taskCurrent].notifyPending = false;
+            }
+            else
+            {
+                tcb[taskCurrent].notifyClearMask = clearMask;
+                tcb[taskCurrent].ticks = timeout;
+                tcb[taskCurrent].state = STATE_BLOCKED_NOTIFY;
+                NVIC_INT_CTRL_R |= (1 << 28);
             }
-            psp[0] = 0;
             break;
         }
-        case 7: // REBOOT
+        case 26: // READ LOCK
         {
-            // Request system reset
-            NVIC_APINT_R = 0x05FA0004;
+            uint8_t slot = objectSlot((handle)psp[0], OBJ_RWLOCK);
+            uint32_t timeout = psp[1];
+
+            if (slot == MAX_OBJECTS)
+            {
+                psp[0] = (uint32_t)RTOS_ERR_INVALID;
+                break;
+            }
+
+            rwlock *rw = &objects[slot].u.rw;
+            psp[0] = RTOS_OK;
 
+            // A second hold would wait forever behind a queued writer
+            if (rw->writer == taskCurrent || (rw->readHolders & (1 << taskCurrent)))
+                psp[0] = (uint32_t)RTOS_ERR_DEADLOCK;
+            else if (readersMayEnter(rw, taskCurrent))
+            {
+                rw->readHolders |= 1 << taskCurrent;
+                rw->readCount++;
+            }
+            else
+                blockOn(&rw->readers, STATE_BLOCKED_RWLOCK, timeout);
             break;
         }
-        case 8: // killThread
+        case 27: // READ UNLOCK
         {
-            _fn fn = (_fn)psp[0];
+            uint8_t slot = objectSlot((handle)psp[0], OBJ_RWLOCK);
 
-            if (fn != 0)
+            if (slot == MAX_OBJECTS || !(objects[slot].u.rw.readHolders & (1 << taskCurrent)))
             {
-                int i, j;
-                int idx = -1;
+                psp[0] = (uint32_t)RTOS_ERR_INVALID;
+                break;
+            }
 
-                // Find the TCB for thread
-                for (i = 0; i < MAX_TASKS; i++)
-                {
-                    if (tcb[i].pid == fn && tcb[i].state != STATE_INVALID)
-                    {
-                        idx = i;
-                        break;
-                    }
-                }
+            rwlock *rw = &objects[slot].u.rw;
+            rw->readHolders &= ~(1 << taskCurrent);
+            rw->readCount--;
+            grantRwLock(rw);
+            psp[0] = RTOS_OK;
+            break;
+        }
+        case 28: // WRITE LOCK
+        {
+            uint8_t slot = objectSlot((handle)psp[0], OBJ_RWLOCK);
+            uint32_t timeout = psp[1];
 
-                if (idx >= 0)
-                {
-                    // Remove from semaphore wait queue
-                    if (tcb[idx].semaphore < MAX_SEMAPHORES)
-                    {
-                        uint8_t s = tcb[idx].semaphore;
-                        semaphore *sem = &semaphores[s];
+            if (slot == MAX_OBJECTS)
+            {
+                psp[0] = (uint32_t)RTOS_ERR_INVALID;
+                break;
+            }
 
-                        for (j = 0; j < sem->queueSize; )
-                        {
-                            if (sem->processQueue[j] == idx)
-                            {
-                                int k;
-                                for (k = j + 1; k < sem->queueSize; k++)
-                                    sem->processQueue[k-1] = sem->processQueue[k];
-                                sem->queueSize--;
-                            }
-                            else
-                            {
-                                j++;
-                            }
-                        }
-                        tcb[idx].semaphore = 0xFF;
-                    }
+            rwlock *rw = &objects[slot].u.rw;
+            psp[0] = RTOS_OK;
 
-                    // Clean up mutexes ownership + wait queues
-                    for (i = 0; i < MAX_MUTEXES; i++)
-                    {
-                        mutex *mtx = &mutexes[i];
+            if (rw->writer == taskCurrent || (rw->readHolders & (1 << taskCurrent)))
+                psp[0] = (uint32_t)RTOS_ERR_DEADLOCK;
+            else if (rw->writer == NO_TASK && rw->readCount == 0)
+                rw->writer = taskCurrent;
+            else
+                blockOn(&rw->writers, STATE_BLOCKED_RWLOCK, timeout);
+            break;
+        }
+        case 29: // WRITE UNLOCK
+        {
+            uint8_t slot = objectSlot((handle)psp[0], OBJ_RWLOCK);
 
-                        // If thread owns the mutex
-                        if (mtx->lock && mtx->lockedBy == idx)
-                        {
-                            if (mtx->queueSize > 0)
-                            {
-                                uint8_t next = mtx->processQueue[0];
-
-                                for (j = 1; j < mtx->queueSize; j++)
-                                    mtx->processQueue[j-1] = mtx->processQueue[j];
-                                mtx->queueSize--;
-
-                                mtx->lockedBy = next;
-                                tcb[next].mutex = i;
-                                tcb[next].state = STATE_READY;
-                            }
-                            else
-                            {
-                                mtx->lock = false;
-                                mtx->lockedBy = 0xFF;
-                            }
-                        }
+            if (slot == MAX_OBJECTS || objects[slot].u.rw.writer != taskCurrent)
+            {
+                psp[0] = (uint32_t)RTOS_ERR_INVALID;
+                break;
+            }
 
-                        // If thread is waiting on mutex remove it
-                        for (j = 0; j < mtx->queueSize; )
-                        {
-                            if (mtx->processQueue[j] == idx)
-                            {
-                                int k;
-                                for (k = j + 1; k < mtx->queueSize; k++)
-                                    mtx->processQueue[k-1] = mtx->processQueue[k];
-                                mtx->queueSize--;
-                            }
-                            else
-                            {
-                                j++;
-                            }
-                        }
-                    }
-                    tcb[idx].mutex = 0xFF;
+            objects[slot].u.rw.writer = NO_TASK;
+            grantRwLock(&objects[slot].u.rw);
+            psp[0] = RTOS_OK;
+            break;
+        }
+        case 30: // CONDITION WAIT
+        {
+            uint8_t slot = objectSlot((handle)psp[0], OBJ_CONDVAR);
+            uint8_t mtx = objectSlot((handle)psp[1], OBJ_MUTEX);
+            uint32_t timeout = psp[2];
 
-                    // Free the threads stack
-                    if (idx != taskCurrent && tcb[idx].stackBase != 0)
-                    {
-                        free_heap(tcb[idx].stackBase, (uint16_t)(idx + 1));
-                        tcb[idx].stackBase = 0;
-                    }
+            // Caller must hold the mutex exactly once so one unlock frees it
+            if (slot == MAX_OBJECTS || mtx == MAX_OBJECTS || mutexOwner(mtx) != taskCurrent ||
+                (IPC_SHARED->word[mtx] & MUTEX_COUNT_M) != MUTEX_COUNT_ONE)
+            {
+                psp[0] = (uint32_t)RTOS_ERR_INVALID;
+                break;
+            }
 
-                    // Mark TCB as killed
-                    tcb[idx].state      = STATE_KILLED;
-                    tcb[idx].sp         = 0;
-                    tcb[idx].ticks      = 0;
-                    tcb[idx].runTime    = 0;
-                    tcb[idx].cpuPercent = 0;
+            // Release and enqueue in one kernel entry so no signal is missed
+            tcb[taskCurrent].condMutex = (handle)psp[1];
+            releaseMutex(mtx);
+            blockOn(&objects[slot].u.cv.waiters, STATE_BLOCKED_COND, timeout);
+            break;
+        }
+        case 31: // CONDITION SIGNAL / BROADCAST
+        {
+            uint8_t slot = objectSlot((handle)psp[0], OBJ_CONDVAR);
+            bool all = (bool)psp[1];
 
-                    // If killed the running task reschedule
-                    if (idx == taskCurrent)
-                    {
-                        NVIC_INT_CTRL_R |= (1 << 28);
-                    }
-                }
+            if (slot == MAX_OBJECTS)
+            {
+                psp[0] = (uint32_t)RTOS_ERR_INVALID;
+                break;
+            }
+
+            // Waiters go straight to the mutex queue, at most one becomes ready
+            waitQueue *q = &objects[slot].u.cv.waiters;
+            while (q->head != NO_TASK)
+            {
+                requeueOnMutex(q->head, RTOS_OK);
+                if (!all)
+                    break;
             }
+            psp[0] = RTOS_OK;
             break;
         }
-        case 9: // restartThread
+        case 32: // WAIT ANY
         {
-            _fn fn = (_fn)psp[0];
-
-            if (fn != 0)
+            const handle *handles = (const handle *)psp[0];
+            uint8_t count = (uint8_t)psp[1];
+            uint32_t timeout = psp[2];
+            uint8_t slot;
+            int32_t ready = -1;
+
+            if (count == 0 || count > MAX_OBJECTS ||
+                !isReadableByTask(taskCurrent, (uint32_t)handles, count * sizeof(handle)))
             {
-                uint32_t savedMask = tcb[taskCurrent].srd;
-                applySramAccessMask(0x00000000);
+                psp[0] = (uint32_t)RTOS_ERR_INVALID;
+                break;
+            }
 
-                int i;
-                int idx = -1;
+            for (i = 0; i < count; i++)
+            {
+                slot = HANDLE_SLOT(handles[i]);
+                if (slot >= MAX_OBJECTS || objects[slot].generation != HANDLE_GENERATION(handles[i]) ||
+                    (objects[slot].type != OBJ_SEMAPHORE && objects[slot].type != OBJ_QUEUE &&
+                     objects[slot].type != OBJ_FLAGS))
+                    break;
+                if (ready < 0 && isObjectReady(slot))
+                    ready = i;
+            }
 
-                // Find TCB for this function
-                for (i = 0; i < MAX_TASKS; i++)
+            if (i < count)
+                psp[0] = (uint32_t)RTOS_ERR_INVALID;
+            else if (ready >= 0)
+                psp[0] = ready;
+            else
+            {
+                // Posts must trap while anyone polls a semaphore
+                for (i = 0; i < count; i++)
                 {
-                    if (tcb[i].pid == fn && tcb[i].state != STATE_INVALID)
-                    {
-                        idx = i;
-                        break;
-                    }
+                    slot = HANDLE_SLOT(handles[i]);
+                    objects[slot].pollers |= 1 << taskCurrent;
+                    if (objects[slot].type == OBJ_SEMAPHORE)
+                        IPC_SHARED->word[slot] |= SEM_WAITERS;
                 }
+                tcb[taskCurrent].pollHandles = handles;
+                tcb[taskCurrent].pollCount   = count;
+                tcb[taskCurrent].ticks       = timeout;
+                tcb[taskCurrent].state       = STATE_BLOCKED_POLL;
+                NVIC_INT_CTRL_R |= (1 << 28);
+            }
+            break;
+        }
+        case 33: // SET FLAGS
+        {
+            uint8_t slot = objectSlot((handle)psp[0], OBJ_FLAGS);
+            if (slot == MAX_OBJECTS)
+            {
+                psp[0] = (uint32_t)RTOS_ERR_INVALID;
+                break;
+            }
 
-                if (idx >= 0)
-                {
-                    // Free old stack
-                    if (tcb[idx].stackBase != 0)
-                    {
-                        free_heap(tcb[idx].stackBase, (uint16_t)(idx + 1));
-                        tcb[idx].stackBase = 0;
-                    }
+            flagGroup *fg = &objects[slot].u.flags;
+            uint32_t consumed = 0;
+            uint8_t task = fg->waiters.head;
 
-                    // Allocate new stack using recorded size
-                    uint32_t stackBytes = tcb[idx].stackSize;
-                    if (stackBytes == 0)
-                        stackBytes = 1024;  // fallback
+            fg->bits |= psp[1];
+            while (task != NO_TASK)
+            {
+                uint8_t next = tcb[task].nextWaiter;
+                uint32_t match = fg->bits & tcb[task].flagMask;
 
-                    uint8_t *stackBase = (uint8_t *)malloc_heap(stackBytes, (uint16_t)(idx + 1));
-                    if (stackBase != 0)
-                    {
-                        uint8_t *stackTop = stackBase + stackBytes;
-                        // 8-byte align
-                        stackTop = (uint8_t *)(((uint32_t)stackTop) & 0xFFFFFFF8);
+                if ((tcb[task].flagMode & FLAGS_ALL) ? match == tcb[task].flagMask : match != 0)
+                {
+                    if (tcb[task].flagMode & FLAGS_CLEAR)
+                        consumed |= match;
+                    wakeTask(task, (int32_t)fg->bits);
+                    NVIC_INT_CTRL_R |= (1 << 28);
+                }
+                task = next;
+            }
+            fg->bits &= ~consumed;
 
-                        tcb[idx].stackBase = stackBase;
-                        tcb[idx].sp        = (void *)stackTop;
+            if (fg->bits != 0)
+                wakePollers(slot);
+            psp[0] = RTOS_OK;
+            break;
+        }
+        case 34: // CLEAR FLAGS
+        {
+            uint8_t slot = objectSlot((handle)psp[0], OBJ_FLAGS);
+            if (slot == MAX_OBJECTS)
+            {
+                psp[0] = (uint32_t)RTOS_ERR_INVALID;
+                break;
+            }
+
+            objects[slot].u.flags.bits &= ~psp[1];
+            psp[0] = RTOS_OK;
+            break;
+        }
+        case 35: // WAIT FLAGS
+        {
+            uint8_t slot = objectSlot((handle)psp[0], OBJ_FLAGS);
+            uint32_t mask = psp[1];
+            uint8_t mode = (uint8_t)psp[2];
+            uint32_t timeout = psp[3];
 
-                        // Rebuild MPU SRD mask for new stack
-                        tcb[idx].srd = createSramAccessMaskForStack((uint32_t)stackBase, stackBytes);
+            if (slot == MAX_OBJECTS || mask == 0)
+            {
+                psp[0] = 0;
+                break;
+            }
 
-                        // Reset runtime fields and state
-                        tcb[idx].ticks       = 0;
-                        tcb[idx].runTime     = 0;
-                        tcb[idx].cpuPercent  = 0;
-                        tcb[idx].mutex       = 0xFF;
-                        tcb[idx].semaphore   = 0xFF;
-                        tcb[idx].state       = STATE_UNRUN;
-                    }
-                    // else: allocation failed
-                }
+            flagGroup *fg = &objects[slot].u.flags;
+            uint32_t match = fg->bits & mask;
 
-                // Restore original mask
-                applySramAccessMask(savedMask);
+            if ((mode & FLAGS_ALL) ? match == mask : match != 0)
+            {
+                psp[0] = fg->bits;
+                if (mode & FLAGS_CLEAR)
+                    fg->bits &= ~match;
+            }
+            else
+            {
+                tcb[taskCurrent].flagMask = mask;
+                tcb[taskCurrent].flagMode = mode;
+                blockOn(&fg->waiters, STATE_BLOCKED_FLAGS, timeout);
             }
             break;
         }
-        case 10: // setThreadPriority
+        case 36: // MESSAGE SEND
         {
-            _fn fn = (_fn)psp[0];      // R0 = function pointer
-            uint8_t prio = (uint8_t)psp[1];  // R1 = priority
+            _fn fn = (_fn)psp[0];
+            const msgBuf *request = (const msgBuf *)psp[1];
+            const msgBuf *reply = (const msgBuf *)psp[2];
+            uint8_t idx = 0;
+
+            while (idx < MAX_TASKS &&
+                   (tcb[idx].pid != fn || tcb[idx].state == STATE_INVALID || tcb[idx].state == STATE_KILLED))
+                idx++;
+
+            if (fn == 0 || idx == MAX_TASKS || idx == taskCurrent ||
+                !isReadableByTask(taskCurrent, (uint32_t)request, sizeof(msgBuf)) ||
+                !isReadableByTask(taskCurrent, (uint32_t)reply, sizeof(msgBuf)) ||
+                !isReadableByTask(taskCurrent, (uint32_t)request->data, request->size) ||
+                !isWritableByTask(taskCurrent, (uint32_t)reply->data, reply->size))
+            {
+                psp[0] = (uint32_t)RTOS_ERR_INVALID;
+                break;
+            }
 
-            if (fn != 0)
+            tcb[taskCurrent].request   = *request;
+            tcb[taskCurrent].reply     = *reply;
+            tcb[taskCurrent].msgServer = idx;
+
+            if (tcb[idx].state == STATE_RECEIVE_BLOCKED)
             {
+                // Server is waiting, one switch straight into it
                 uint32_t savedMask = tcb[taskCurrent].srd;
                 applySramAccessMask(0x00000000);
+                wakeTask(idx, deliverRequest(taskCurrent, tcb[idx].receiveBuf));
+                applySramAccessMask(savedMask);
+                NVIC_INT_CTRL_R |= (1 << 28);
+            }
+            else
+                blockOn(&tcb[idx].senders, STATE_SEND_BLOCKED, WAIT_FOREVER);
 
-                // Clamp to valid range
-                if (prio >= NUM_PRIORITIES)
-                    prio = NUM_PRIORITIES - 1;
+            // Server runs at the client's priority until it replies
+            inheritPriority(idx, tcb[taskCurrent].currentPriority);
+            break;
+        }
+        case 37: // MESSAGE RECEIVE
+        {
+            msgBuf *request = (msgBuf *)psp[0];
 
-                int i;
-                for (i = 0; i < MAX_TASKS; i++)
-                {
-                    if (tcb[i].pid == fn &&
-                        tcb[i].state != STATE_INVALID &&
-                        tcb[i].state != STATE_KILLED)
-                    {
-                        tcb[i].priority        = prio;
-                        tcb[i].currentPriority = prio;
-                        break;
-                    }
-                }
+            if (!isWritableByTask(taskCurrent, (uint32_t)request, sizeof(msgBuf)) ||
+                !isWritableByTask(taskCurrent, (uint32_t)request->data, request->size))
+            {
+                psp[0] = (uint32_t)RTOS_ERR_INVALID;
+                break;
+            }
 
+            uint8_t client = tcb[taskCurrent].senders.head;
+            if (client != NO_TASK)
+            {
+                uint32_t savedMask = tcb[taskCurrent].srd;
+                applySramAccessMask(0x00000000);
+                unlinkWaiter(client);
+                psp[0] = deliverRequest(client, request);
                 applySramAccessMask(savedMask);
-
-                // Let scheduler consider if needed
-                if (priorityScheduler && preemption)
-                    NVIC_INT_CTRL_R |= (1 << 28);
+            }
+            else
+            {
+                tcb[taskCurrent].receiveBuf = request;
+                tcb[taskCurrent].state = STATE_RECEIVE_BLOCKED;
+                NVIC_INT_CTRL_R |= (1 << 28);
             }
             break;
         }
-        case 11: // ps()
+        case 38: // MESSAGE REPLY
         {
+            int32_t id = (int32_t)psp[0];
+            const void *data = (const void *)psp[1];
+            uint32_t size = psp[2];
+            uint8_t client = (uint8_t)(id - 1);
+
+            if (id < 1 || id > MAX_TASKS || tcb[client].state != STATE_REPLY_BLOCKED ||
+                tcb[client].msgServer != taskCurrent ||
+                !isReadableByTask(taskCurrent, (uint32_t)data, size))
+            {
+                psp[0] = (uint32_t)RTOS_ERR_INVALID;
+                break;
+            }
+
+            if (size > tcb[client].reply.size)
+                size = tcb[client].reply.size;
+
             uint32_t savedMask = tcb[taskCurrent].srd;
             applySramAccessMask(0x00000000);
+            copyBytes(tcb[client].reply.data, data, size);
+            applySramAccessMask(savedMask);
 
-            putsUart0("\nNAME            STATE     PRIO  %CPU\n");
-            putsUart0("--------------------------------------\n");
+            tcb[client].msgServer = NO_TASK;
+            wakeTask(client, (int32_t)size);
+            updateInheritedPriority(taskCurrent);
+            NVIC_INT_CTRL_R |= (1 << 28);
+            psp[0] = RTOS_OK;
+            break;
+        }
+        case 39: // PIPE WRITE
+        {
+            uint8_t slot = objectSlot((handle)psp[0], OBJ_PIPE);
+            const uint8_t *data = (const uint8_t *)psp[1];
+            uint32_t size = psp[2];
+            uint32_t timeout = psp[3];
 
-            int i, j;
-            char str[12];
+            if (slot == MAX_OBJECTS || !isReadableByTask(taskCurrent, (uint32_t)data, size))
+            {
+                psp[0] = (uint32_t)RTOS_ERR_INVALID;
+                break;
+            }
 
-            for (i = 0; i < MAX_TASKS; i++)
+            pipe *p = &objects[slot].u.p;
+            uint32_t done = 0;
+            uint32_t n;
+
+            // Queue behind earlier writers so their bytes stay in order
+            if (p->writers.head == NO_TASK)
             {
-                if (tcb[i].state != STATE_INVALID && tcb[i].pid != 0)
+                do
                 {
-                    // Name
-                    putsUart0(tcb[i].name);
-                    for (j = stringLen(tcb[i].name); j < 15; j++)
-                        putcUart0(' ');
-
-                    // State
-                    switch (tcb[i].state)
-                    {
-                        case STATE_UNRUN:             putsUart0("UNRUN   "); break;
-                        case STATE_READY:             putsUart0("READY   "); break;
-                        case STATE_DELAYED:           putsUart0("DELAYED "); break;
-                        case STATE_BLOCKED_SEMAPHORE: putsUart0("SEM_BLK "); break;
-                        case STATE_BLOCKED_MUTEX:     putsUart0("MTX_BLK "); break;
-                        case STATE_KILLED:            putsUart0("KILLED  "); break;
-                        default:                      putsUart0("INVLD   "); break;
-                    }
+                    n = pipePut(p, data + done, size - done);
+                    done += n;
+                    pipeService(p);
+                } while (n > 0 && done < size);
+            }
 
-                    // Priority
-                    itoa(tcb[i].priority, str, 10);
-                    putsUart0(str);
-                    putsUart0("   ");
+            if (done == size)
+                psp[0] = size;
+            else
+            {
+                tcb[taskCurrent].pipeBuf.data = (void *)data;
+                tcb[taskCurrent].pipeBuf.size = size;
+                tcb[taskCurrent].pipeDone     = done;
+                blockOn(&p->writers, STATE_BLOCKED_PIPE, timeout);
+            }
+            break;
+        }
+        case 40: // PIPE READ
+        {
+            uint8_t slot = objectSlot((handle)psp[0], OBJ_PIPE);
+            uint8_t *data = (uint8_t *)psp[1];
+            uint32_t size = psp[2];
+            uint32_t timeout = psp[3];
 
-                    // %CPU
-                    uint32_t pct   = tcb[i].cpuPercent;  // scaled 100
-                    uint32_t whole = pct / 100;
-                    uint32_t frac  = pct % 100;
+            if (slot == MAX_OBJECTS || size == 0 || !isWritableByTask(taskCurrent, (uint32_t)data, size))
+            {
+                psp[0] = (uint32_t)RTOS_ERR_INVALID;
+                break;
+            }
 
-                    char wbuf[8], fbuf[4];
-                    itoa(whole, wbuf, 10);
-                    itoa(frac,  fbuf, 10);
+            pipe *p = &objects[slot].u.p;
+            uint32_t threshold = size < p->trigger ? size : p->trigger;
 
-                    putsUart0(wbuf);
-                    putcUart0('.');
-                    if (frac < 10) putcUart0('0');
-                    putsUart0(fbuf);
-                    putsUart0("\n");
-                }
+            if (p->readers.head == NO_TASK && p->count >= threshold)
+            {
+                psp[0] = pipeGet(p, data, size);
+                pipeService(p);
+            }
+            else
+            {
+                tcb[taskCurrent].pipeBuf.data = data;
+                tcb[taskCurrent].pipeBuf.size = size;
+                tcb[taskCurrent].pipeDone     = 0;
+                blockOn(&p->readers, STATE_BLOCKED_PIPE, timeout);
             }
-
-            applySramAccessMask(savedMask);
             break;
         }
-        case 12: // ipcs()
+        case 41: // PIPE SET TRIGGER
         {
-            uint32_t savedMask = tcb[taskCurrent].srd;
-            applySramAccessMask(0x00000000);
+            uint8_t slot = objectSlot((handle)psp[0], OBJ_PIPE);
+            uint16_t level = (uint16_t)psp[1];
 
-            putsUart0("\nIPC TYPE  ID   STATE/INFO\n");
-            putsUart0("--------------------------------------\n");
+            if (slot == MAX_OBJECTS || level == 0 || level > objects[slot].u.p.size)
+            {
+                psp[0] = (uint32_t)RTOS_ERR_INVALID;
+                break;
+            }
 
-            char str[12];
-            int i, j;
+            // A lower level may already satisfy a waiting reader
+            objects[slot].u.p.trigger = level;
+            pipeService(&objects[slot].u.p);
+            psp[0] = RTOS_OK;
+            break;
+        }
+        case 42: // PUBLISH
+        {
+            uint8_t slot = objectSlot((handle)psp[0], OBJ_TOPIC);
+            const void *data = (const void *)psp[1];
+            uint32_t size = psp[2];
 
-            // SEMAPHORES
-            for (i = 0; i < MAX_SEMAPHORES; i++)
+            if (slot == MAX_OBJECTS || size == 0 || size > objects[slot].u.t.size ||
+                !isReadableByTask(taskCurrent, (uint32_t)data, size))
             {
-                if (semaphores[i].count == 0 && semaphores[i].queueSize == 0)
-                    continue;
+                psp[0] = (uint32_t)RTOS_ERR_INVALID;
+                break;
+            }
 
-                putsUart0("SEM      ");
-                itoa(i, str, 10);
-                putsUart0(str);
-                putsUart0("   count=");
-                itoa(semaphores[i].count, str, 10);
-                putsUart0(str);
-                putsUart0("  waiting=");
-                itoa(semaphores[i].queueSize, str, 10);
-                putsUart0(str);
+            uint8_t s = 0;
+            while (s < TOPIC_SAMPLES && sampleRefs[s] != 0)
+                s++;
+            if (s == TOPIC_SAMPLES)
+            {
+                psp[0] = (uint32_t)RTOS_ERR_NOMEM;
+                break;
+            }
 
-                if (semaphores[i].queueSize > 0)
+            // The topic keeps one reference to its latest sample
+            topic *t = &objects[slot].u.t;
+            copyBytes(topicPool + s * TOPIC_SAMPLE_SIZE, data, size);
+            sampleLength[s] = size;
+            sampleRefs[s] = 1;
+            if (t->latest != NO_SAMPLE)
+                sampleRefs[t->latest]--;
+            t->latest  = s;
+            t->pending = t->subscribers;
+
+            // Every waiter is readied in this one kernel entry
+            if (t->waiters.head != NO_TASK)
+            {
+                uint32_t savedMask = tcb[taskCurrent].srd;
+                applySramAccessMask(0x00000000);
+                while (t->waiters.head != NO_TASK)
                 {
-                    putsUart0("  [");
-                    for (j = 0; j < semaphores[i].queueSize; j++)
-                    {
-                        uint8_t pidIdx = semaphores[i].processQueue[j];
-                        if (pidIdx < MAX_TASKS)
-                        {
-                            putsUart0(tcb[pidIdx].name);
-                            if (j < semaphores[i].queueSize - 1)
-                                putsUart0(", ");
-                        }
-                    }
-                    putsUart0("]");
+                    uint8_t task = t->waiters.head;
+                    wakeTask(task, takeSample(task, t, tcb[task].samplePtr));
                 }
-                putsUart0("\n");
+                applySramAccessMask(savedMask);
+                NVIC_INT_CTRL_R |= (1 << 28);
             }
+            psp[0] = RTOS_OK;
+            break;
+        }
+        case 43: // TOPIC TAKE
+        {
+            uint8_t slot = objectSlot((handle)psp[0], OBJ_TOPIC);
+            const void **sample = (const void **)psp[1];
+            uint32_t timeout = psp[2];
 
-            // MUTEXES
-            for (i = 0; i < MAX_MUTEXES; i++)
+            if (slot == MAX_OBJECTS || !(objects[slot].u.t.subscribers & (1 << taskCurrent)) ||
+                !isWritableByTask(taskCurrent, (uint32_t)sample, sizeof(void *)))
             {
-                if (!mutexes[i].lock && mutexes[i].queueSize == 0)
-                    continue;
+                psp[0] = (uint32_t)RTOS_ERR_INVALID;
+                break;
+            }
 
-                putsUart0("MUTEX    ");
-                itoa(i, str, 10);
-                putsUart0(str);
+            topic *t = &objects[slot].u.t;
+            if (t->pending & (1 << taskCurrent))
+                psp[0] = takeSample(taskCurrent, t, sample);
+            else
+            {
+                tcb[taskCurrent].samplePtr = sample;
+                blockOn(&t->waiters, STATE_BLOCKED_TOPIC, timeout);
+            }
+            break;
+        }
+        case 44: // TOPIC RELEASE
+        {
+            uint32_t offset = psp[0] - (uint32_t)topicPool;
+            uint8_t s = offset / TOPIC_SAMPLE_SIZE;
 
-                putsUart0("   locked=");
-                putsUart0(mutexes[i].lock ? "1" : "0");
+            if (psp[0] < (uint32_t)topicPool || offset >= TOPIC_POOL_SIZE ||
+                !(tcb[taskCurrent].topicSamples & (1 << s)))
+            {
+                psp[0] = (uint32_t)RTOS_ERR_INVALID;
+                break;
+            }
 
-                putsUart0("  by=");
-                if (mutexes[i].lock && mutexes[i].lockedBy < MAX_TASKS)
-                    putsUart0(tcb[mutexes[i].lockedBy].name);
-                else
-                    putsUart0("---");
+            setTopicSamples(taskCurrent, tcb[taskCurrent].topicSamples & ~(1 << s));
+            sampleRefs[s]--;
+            psp[0] = RTOS_OK;
+            break;
+        }
+        case 45: // SUBSCRIBE / UNSUBSCRIBE
+        {
+            uint8_t slot = objectSlot((handle)psp[0], OBJ_TOPIC);
+            bool on = (bool)psp[1];
 
-                putsUart0("  waiting=");
-                itoa(mutexes[i].queueSize, str, 10);
-                putsUart0(str);
+            if (slot == MAX_OBJECTS)
+            {
+                psp[0] = (uint32_t)RTOS_ERR_INVALID;
+                break;
+            }
 
-                if (mutexes[i].queueSize > 0)
-                {
-                    putsUart0("  [");
-                    for (j = 0; j < mutexes[i].queueSize; j++)
-                    {
-                        uint8_t pidIdx = mutexes[i].processQueue[j];
-                        if (pidIdx < MAX_TASKS)
-                        {
-                            putsUart0(tcb[pidIdx].name);
-                            if (j < mutexes[i].queueSize - 1)
-                                putsUart0(", ");
-                        }
-                    }
-                    putsUart0("]");
-                }
+            topic *t = &objects[slot].u.t;
+            if (on)
+                t->subscribers |= 1 << taskCurrent;
+            else
+                t->subscribers &= ~(1 << taskCurrent);
+            t->pending &= ~(1 << taskCurrent);
+            psp[0] = RTOS_OK;
+            break;
+        }
+        case 46: // BARRIER WAIT
+        {
+            uint8_t slot = objectSlot((handle)psp[0], OBJ_BARRIER);
+            if (slot == MAX_OBJECTS)
+            {
+                psp[0] = (uint32_t)RTOS_ERR_INVALID;
+                break;
+            }
 
-                putsUart0("\n");
+            barrier *b = &objects[slot].u.b;
+            if (++b->arrived < b->parties)
+            {
+                blockOn(&b->waiters, STATE_BLOCKED_BARRIER, WAIT_FOREVER);
+                break;
             }
 
-            applySramAccessMask(savedMask);
+            // Last arrival readies every waiter, one switch decides who runs
+            b->arrived = 0;
+            b->phase++;
+            if (b->waiters.head != NO_TASK)
+            {
+                wakeAll(&b->waiters, RTOS_OK);
+                NVIC_INT_CTRL_R |= (1 << 28);
+            }
+            psp[0] = BARRIER_LAST;
             break;
         }
-        case 13: // PI
+        case 47: // DEADLOCK POLICY
         {
-            bool on = (bool)psp[0];  // R0
+            uint8_t policy = (uint8_t)psp[0];
 
             uint32_t savedMask = tcb[taskCurrent].srd;
             applySramAccessMask(0x00000000);
 
-            priorityInheritance = on;
-            putsUart0(on ? "pi on\n" : "pi off\n");
+            if (policy <= DEADLOCK_ABORT)
+                deadlockPolicy = policy;
+            putsUart0(deadlockPolicy == DEADLOCK_OFF ? "deadlock off\n" :
+                      deadlockPolicy == DEADLOCK_REPORT ? "deadlock report\n" : "deadlock abort\n");
 
             applySramAccessMask(savedMask);
             break;
         }
-
-        case 14: // PREEMPT
+        case 48: // LOCK STATS
         {
             bool on = (bool)psp[0];
 
             uint32_t savedMask = tcb[taskCurrent].srd;
             applySramAccessMask(0x00000000);
 
-            preemption = on;
-            putsUart0(on ? "preempt on\n" : "preempt off\n");
+            lockStatsAll = on;
+            for (i = 0; i < MAX_OBJECTS; i++)
+            {
+                if (objects[i].type != OBJ_FREE)
+                    IPC_SHARED->tag[i] = fastPathTag(i);
+            }
+            putsUart0(on ? "lockstats on\n" : "lockstats off\n");
 
             applySramAccessMask(savedMask);
             break;
         }
+        case 49: // HEAP BENCH
+        {
+            uint32_t savedMask = tcb[taskCurrent].srd;
+            applySramAccessMask(0x00000000);
 
-        case 15: // SCHED
+            heapBench();
+
+            applySramAccessMask(savedMask);
+            break;
+        }
+        case 50: // HEAP
         {
-            bool prio_on = (bool)psp[0];
+            uint32_t savedMask = tcb[taskCurrent].srd;
+            applySramAccessMask(0x00000000);
+
+            printHeap();
 
+            applySramAccessMask(savedMask);
+            break;
+        }
+        case 53: // SCAN STACKS
+        {
             uint32_t savedMask = tcb[taskCurrent].srd;
             applySramAccessMask(0x00000000);
 
-            priorityScheduler = prio_on;
-            putsUart0(prio_on ? "sched prio\n" : "sched rr\n");
+            scanStackWords(STACK_SCAN_WORDS);
+
+            applySramAccessMask(savedMask);
+            break;
+        }
+        case 54: // STACK
+        {
+            uint32_t savedMask = tcb[taskCurrent].srd;
+            applySramAccessMask(0x00000000);
+
+            printStacks();
 
             applySramAccessMask(savedMask);
             break;
         }
+        case 51: // MALLOC
+        {
+            uint32_t size = psp[0];
+            uint16_t pid = (uint16_t)(taskCurrent + 1);
+            void *p = 0;
+
+            if (size > 0 && size <= HEAP_SIZE)
+                p = malloc_heap((int)size, pid);
+
+            // A new slab or run may push the task past its quota
+            if (p != 0 && taskHeapBlockCount(taskCurrent) > tcb[taskCurrent].heapQuota)
+            {
+                free_heap(p, pid);
+                p = 0;
+            }
+
+            if (p != 0)
+            {
+                updateTaskSramMask(taskCurrent);
+                applySramAccessMask(tcb[taskCurrent].srd);
+            }
+            psp[0] = (uint32_t)p;
+            break;
+        }
+        case 52: // FREE
+        {
+            uint32_t addr = psp[0];
+
+            // The stack is owned by the same pid but is not the caller's to free
+            if (isInStackAllocation(taskCurrent, addr) ||
+                !free_heap((void *)addr, (uint16_t)(taskCurrent + 1)))
+            {
+                psp[0] = (uint32_t)RTOS_ERR_INVALID;
+                break;
+            }
+
+            updateTaskSramMask(taskCurrent);
+            applySramAccessMask(tcb[taskCurrent].srd);
+            psp[0] = RTOS_OK;
+            break;
+        }
         default:
             break;
     }
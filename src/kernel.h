@@ -13,6 +13,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include "mm.h"
 
 //-----------------------------------------------------------------------------
 // RTOS Defines
@@ -20,36 +21,263 @@
 
 typedef void (*_fn)();
 
-// ------------------ Mutex ------------------
-#define MAX_MUTEXES 1
-#define MAX_MUTEX_QUEUE_SIZE 2
-#define resource 0
+// ------------------ Exception Priorities ------------------
+// Priorities use the 3 implemented bits (0 = highest, 7 = lowest)
+// Interrupts numerically below KERNEL_INTERRUPT_PRIORITY are never masked
+// by the kernel and must not call kernel services
+#define KERNEL_INTERRUPT_PRIORITY 2
+#define SVC_PRIORITY              KERNEL_INTERRUPT_PRIORITY
+#define SYSTICK_PRIORITY          KERNEL_INTERRUPT_PRIORITY
+#define PENDSV_PRIORITY           7
+#define PRIORITY_TO_BASEPRI(p)    ((p) << 5)
 
+// ------------------ Kernel Return Codes ------------------
+#define RTOS_OK           0
+#define RTOS_ERR_TIMEOUT -1
+#define RTOS_ERR_AGAIN   -2
+#define RTOS_ERR_INVALID -3
+#define RTOS_ERR_DELETED -4
+#define RTOS_ERR_NOMEM   -5
+#define RTOS_ERR_DEADLOCK -6
+
+#define WAIT_FOREVER      0         // timeout in ticks, 0 never expires
+
+// What lock() does when blocking would close a cycle of mutex owners
+#define DEADLOCK_OFF      0         // block anyway, no check
+#define DEADLOCK_REPORT   1         // print the cycle then block
+#define DEADLOCK_ABORT    2         // print the cycle and return RTOS_ERR_DEADLOCK
+
+// ipcs views
+#define IPCS_OBJECTS      0
+#define IPCS_WAIT_FOR     1         // blocked tasks and who they wait for
+#define IPCS_RESET        2         // clear lock statistics
+
+// ------------------ Wait Queues ------------------
+// Intrusive list of blocked tasks threaded through tcb[].nextWaiter,
+// kept in priority order with FIFO order among equal priorities
+#define NO_TASK 0xFF
+
+typedef struct _waitQueue
+{
+    uint8_t head;
+} waitQueue;
+
+// ------------------ Futex ------------------
+// Tasks sleep on any word they may access, hashed into a small table
+#define FUTEX_BUCKETS 8
+
+// ------------------ Task Notifications ------------------
+// One 32-bit value per task, no queue since the waiter is the TCB itself
+#define NOTIFY_SET_BITS  0          // value |= bits
+#define NOTIFY_INCREMENT 1          // value += 1, bits ignored
+#define NOTIFY_OVERWRITE 2          // value = bits
+
+// ------------------ Message Passing ------------------
+// msgSend copies the request straight into the server's receive buffer and
+// blocks until msgReply copies the reply back, the server runs at the best
+// priority of the clients waiting on it
+typedef struct _msgBuf
+{
+    void *data;
+    uint32_t size;
+} msgBuf;
+
+// ------------------ Event Flags ------------------
+// waitFlags mode, FLAGS_CLEAR may be or'd with either
+#define FLAGS_ANY        0          // any bit of the mask
+#define FLAGS_ALL        1          // every bit of the mask
+#define FLAGS_CLEAR      2          // clear the matched bits on return
+
+// ------------------ Kernel Objects ------------------
+// Semaphores, mutexes and queues come from one pool and are addressed by
+// handles holding the slot in the low byte and a generation in the high byte
+// so a handle to a deleted object is rejected
+#define MAX_OBJECTS      32
+#define OBJECT_NAME_SIZE 12
+#define INVALID_HANDLE   0
+#define NO_OBJECT        0xFF
+
+#define OBJ_FREE         0
+#define OBJ_SEMAPHORE    1
+#define OBJ_MUTEX        2
+#define OBJ_QUEUE        3
+#define OBJ_RWLOCK       4
+#define OBJ_CONDVAR      5
+#define OBJ_FLAGS        6
+#define OBJ_PIPE         7
+#define OBJ_TOPIC        8
+#define OBJ_BARRIER      9
+
+typedef uint16_t handle;
+
+#define HANDLE_SLOT(h)        ((h) & 0xFF)
+#define HANDLE_GENERATION(h)  ((h) >> 8)
+
+// Owner, lock count and waiters live in the object word of the shared IPC block
+// Mutexes the kernel knows are held are linked into tcb[].heldMutexes
+// Tasks can write the word, so the held list only trusts heldBy
 typedef struct _mutex
 {
-    bool lock;
-    uint8_t queueSize;
-    uint8_t processQueue[MAX_MUTEX_QUEUE_SIZE];
-    uint8_t lockedBy;
+    waitQueue waiters;
+    uint8_t nextHeld;
+    uint8_t heldBy;                 // task whose held list has it, NO_TASK if none
 } mutex;
 
-// ------------------ Semaphore ------------------
-#define MAX_SEMAPHORES 3
-#define MAX_SEMAPHORE_QUEUE_SIZE 2
-#define keyPressed 0
-#define keyReleased 1
-#define flashReq 2
-
+// Count and waiters live in the object word of the shared IPC block
 typedef struct _semaphore
 {
-    uint8_t count;
-    uint8_t queueSize;
-    uint8_t processQueue[MAX_SEMAPHORE_QUEUE_SIZE];
+    waitQueue waiters;
 } semaphore;
 
+// Fixed size uint32_t messages, storage allocated when the queue is created
+typedef struct _queue
+{
+    waitQueue readers;
+    waitQueue writers;
+    uint8_t depth;
+    uint8_t count;
+    uint8_t head;
+    uint32_t *items;
+} queue;
+
+// Any number of readers or one writer, a waiting writer holds off new readers
+// of equal or lower priority so writers are not starved
+typedef struct _rwlock
+{
+    waitQueue readers;
+    waitQueue writers;
+    uint8_t writer;                 // task index, NO_TASK if not write locked
+    uint8_t readCount;
+    uint16_t readHolders;           // bit per task index holding a read lock
+} rwlock;
+
+// Waiters give up a mutex and are moved onto its wait queue when signalled
+typedef struct _condvar
+{
+    waitQueue waiters;
+} condvar;
+
+// 32 event bits, waiters keep their mask and mode in the TCB
+typedef struct _flagGroup
+{
+    waitQueue waiters;
+    uint32_t bits;
+} flagGroup;
+
+// Byte ring buffer, a blocked reader is only woken once trigger bytes (or as
+// many as it asked for) are available so a burst costs one wakeup
+typedef struct _pipe
+{
+    waitQueue readers;
+    waitQueue writers;
+    uint8_t *buffer;
+    uint16_t size;
+    uint16_t count;
+    uint16_t head;
+    uint16_t trigger;
+} pipe;
+
+// Samples are copied once into a reference counted pool buffer, subscribers
+// read it in place through MPU region 7 until they release it
+#define TOPIC_SAMPLES     8
+#define TOPIC_SAMPLE_SIZE 256
+#define TOPIC_POOL_SIZE   (TOPIC_SAMPLES * TOPIC_SAMPLE_SIZE)
+#define NO_SAMPLE         0xFF
+
+typedef struct _topic
+{
+    waitQueue waiters;
+    uint16_t subscribers;           // bit per task index
+    uint16_t pending;               // subscribers that have not taken the latest sample
+    uint16_t size;                  // largest sample accepted
+    uint8_t latest;                 // pool sample, NO_SAMPLE until the first publish
+} topic;
+
+// The last of parties tasks to arrive releases the others and the barrier
+// starts the next phase
+#define BARRIER_LAST      1         // barrierWait result for the releasing task
+
+typedef struct _barrier
+{
+    waitQueue waiters;
+    uint8_t parties;
+    uint8_t arrived;
+    uint16_t phase;
+} barrier;
+
+// Mutex and semaphore contention, timed with the DWT cycle counter
+// Acquisitions on the LDREX/STREX fast path are only seen with lockstats on
+#define CYCLES_PER_US     40
+
+typedef struct _lockStats
+{
+    uint32_t acquisitions;
+    uint32_t contended;             // acquisitions that had to block
+    uint32_t holds;                 // mutex holds timed from lock to unlock
+    uint32_t maxWait;               // cycles
+    uint32_t maxHold;               // cycles
+    uint32_t holdStart;
+    uint64_t waitCycles;
+    uint64_t holdCycles;
+    bool holdTimed;
+} lockStats;
+
+typedef struct _kobject
+{
+    uint8_t type;
+    uint8_t generation;
+    uint16_t pollers;               // bit per task index blocked in waitAny on this object
+    char name[OBJECT_NAME_SIZE];
+    union
+    {
+        mutex mtx;
+        semaphore sem;
+        queue q;
+        rwlock rw;
+        condvar cv;
+        flagGroup flags;
+        pipe p;
+        topic t;
+        barrier b;
+    } u;
+} kobject;
+
+// ------------------ Shared IPC Block ------------------
+// First heap block, readable and writable by every task so lock(), unlock(),
+// wait() and post() can update their word with LDREX/STREX in thread mode
+// The kernel is only entered when a task must block or a waiter must be woken
+#define KERNEL_PID     0xFFFF
+#define IPC_SHARED     ((ipcShared *)HEAP_BASE)
+
+#define MUTEX_OWNER_M   0x000000FF  // task index + 1 of owner, 0 = free
+#define MUTEX_COUNT_M   0x00FFFF00  // lock count of the owner
+#define MUTEX_COUNT_ONE 0x00000100
+#define MUTEX_TRACKED   0x20000000  // in the owner's held list, unlock must enter the kernel
+#define MUTEX_RECURSIVE 0x40000000  // owner may lock again
+#define MUTEX_WAITERS   0x80000000  // unlock must enter the kernel
+
+#define SEM_COUNT_M    0x0000FFFF   // available tokens
+#define SEM_WAITERS    0x80000000   // post must enter the kernel
+
+// Tag lets the fast paths check handle, generation and type in one compare
+#define OBJECT_TAG(type, h) (((uint32_t)(type) << 16) | (h))
+
+typedef struct _ipcShared
+{
+    volatile uint32_t current;      // task index + 1 of the running task
+    volatile uint32_t word[MAX_OBJECTS];
+    volatile uint32_t tag[MAX_OBJECTS];         // 0 while the slot is free
+} ipcShared;
+
 // ------------------ Tasks ------------------
 #define MAX_TASKS 12
 
+// Heap blocks a task may own through taskMalloc, its stack not included
+#define TASK_HEAP_QUOTA 4
+
+// Lowest subregion of each stack region is a no-access guard
+#define STACK_GUARD(size) ((size) / 8)
+
 #define STATE_INVALID           0
 #define STATE_UNRUN             1
 #define STATE_READY             2
@@ -57,6 +285,19 @@ typedef struct _semaphore
 #define STATE_BLOCKED_SEMAPHORE 4
 #define STATE_BLOCKED_MUTEX     5
 #define STATE_KILLED            6
+#define STATE_BLOCKED_FUTEX     7
+#define STATE_BLOCKED_QUEUE     8
+#define STATE_BLOCKED_NOTIFY    9
+#define STATE_BLOCKED_RWLOCK    10
+#define STATE_BLOCKED_COND      11
+#define STATE_BLOCKED_POLL      12
+#define STATE_BLOCKED_FLAGS     13
+#define STATE_SEND_BLOCKED      14
+#define STATE_REPLY_BLOCKED     15
+#define STATE_RECEIVE_BLOCKED   16
+#define STATE_BLOCKED_PIPE      17
+#define STATE_BLOCKED_TOPIC     18
+#define STATE_BLOCKED_BARRIER   19
 
 // ------------------ Task Control Block ------------------
 struct _tcb
@@ -69,8 +310,10 @@ struct _tcb
     uint32_t ticks;
     uint64_t srd;
     char name[16];
-    uint8_t mutex;
-    uint8_t semaphore;
+    uint8_t heldMutexes;            // most recently tracked mutex, NO_OBJECT if none
+    uint8_t waitingMutex;           // mutex slot while STATE_BLOCKED_MUTEX
+    uint8_t waitingSemaphore;       // semaphore slot while STATE_BLOCKED_SEMAPHORE
+    uint32_t waitStart;             // cycle count when it blocked on a mutex or semaphore
     uint32_t cpuTime;
     uint16_t percentCPU;
     uint32_t lastStartTime;
@@ -78,35 +321,132 @@ struct _tcb
     uint32_t cpuPercent;
     void    *stackBase;
     uint32_t stackSize;
+    uint8_t  heapQuota;             // blocks, see TASK_HEAP_QUOTA
+    uint32_t stackUnused;           // bytes above the stack bottom still painted
+    uint32_t stackExtra;            // blocks claimed below stackBase by growStack
+    uint32_t stackGrowMax;          // limit for stackExtra, 0 if the stack is fixed
+    waitQueue *blockedOn;           // queue this task is blocked on
+    uint8_t  nextWaiter;
+    bool     resultPending;         // waitResult goes to R0 on dispatch
+    int32_t  waitResult;
+    uint32_t futexAddr;
+    handle   condMutex;             // mutex to reacquire after a condition wait
+    const handle *pollHandles;      // waitAny array, index of the ready one is returned
+    uint8_t  pollCount;
+    uint32_t flagMask;
+    uint8_t  flagMode;
+    waitQueue senders;              // clients blocked in msgSend to this task
+    uint8_t  msgServer;             // server while send or reply blocked
+    msgBuf   request;
+    msgBuf   reply;
+    msgBuf  *receiveBuf;            // server buffer while receive blocked
+    msgBuf   pipeBuf;               // caller buffer while pipe blocked
+    uint32_t pipeDone;              // bytes moved so far
+    uint8_t  topicSamples;          // pool samples the task may read
+    const void **samplePtr;         // where topicTake stores the sample address
+    uint32_t message;               // queue item being sent or received
+    uint32_t *messagePtr;
+    uint32_t notifyValue;
+    uint32_t notifyClearMask;       // bits cleared when notifyWait returns
+    bool     notifyPending;
 };
 
 // ------------------ Global Kernel Objects ------------------
 extern struct _tcb tcb[MAX_TASKS];
 extern uint8_t taskCurrent;
-extern mutex mutexes[MAX_MUTEXES];
-extern semaphore semaphores[MAX_SEMAPHORES];
+extern kobject objects[MAX_OBJECTS];
 extern bool preemption;
 extern bool priorityScheduler;
 extern bool priorityInheritance;
+extern uint8_t deadlockPolicy;
+extern bool lockStatsAll;
 
 // ------------------ Kernel API ------------------
-bool initMutex(uint8_t mutex);
-bool initSemaphore(uint8_t semaphore, uint8_t count);
+handle createSemaphore(uint16_t count, const char name[]);
+handle createMutex(const char name[]);
+handle createRecursiveMutex(const char name[]);
+handle createQueue(uint8_t depth, const char name[]);
+handle createRwLock(const char name[]);
+handle createCondition(const char name[]);
+handle createFlags(const char name[]);
+handle createPipe(uint16_t size, const char name[]);
+handle createTopic(uint16_t sampleSize, const char name[]);
+handle createBarrier(uint8_t parties, const char name[]);
+int32_t deleteObject(handle h);
+handle findObject(const char name[]);
 
 void initRtos(void);
+void initExceptionPriorities(void);
+uint32_t enterCritical(void);
+void leaveCritical(uint32_t basepri);
 void startRtos(void);
+void printMemoryMap(void);
 
 bool createThread(_fn fn, const char name[], uint8_t priority, uint32_t stackBytes);
-void killThread(_fn fn);
+uint32_t killThread(_fn fn);
+uint32_t killTask(uint8_t task);
+bool growStack(uint32_t faultAddr);
 void restartThread(_fn fn);
 void setThreadPriority(_fn fn, uint8_t priority);
+bool setHeapQuota(_fn fn, uint8_t blocks);
+bool setStackGrowth(_fn fn, uint32_t maxBytes);
 
 void yield(void);
-void lock(int8_t mutex);
-void unlock(int8_t mutex);
+int32_t lock(handle mutex);
+int32_t unlock(handle mutex);
+int32_t wait(handle semaphore);
+int32_t post(handle semaphore);
+int32_t queueSend(handle q, uint32_t message, uint32_t timeout);
+int32_t queueReceive(handle q, uint32_t *message, uint32_t timeout);
+int32_t readLock(handle rw, uint32_t timeout);
+int32_t readUnlock(handle rw);
+int32_t writeLock(handle rw, uint32_t timeout);
+int32_t writeUnlock(handle rw);
+int32_t condWait(handle cv, handle mutex, uint32_t timeout);
+int32_t condSignal(handle cv);
+int32_t condBroadcast(handle cv);
+int32_t setFlags(handle flags, uint32_t bits);
+int32_t clearFlags(handle flags, uint32_t bits);
+uint32_t waitFlags(handle flags, uint32_t mask, uint8_t mode, uint32_t timeout);
+int32_t waitAny(const handle objects[], uint8_t count, uint32_t timeout);
+int32_t msgSend(_fn server, const msgBuf *request, const msgBuf *reply);
+int32_t msgReceive(msgBuf *request);
+int32_t msgReply(int32_t client, const void *data, uint32_t size);
+int32_t pipeWrite(handle p, const void *data, uint32_t size, uint32_t timeout);
+int32_t pipeRead(handle p, void *data, uint32_t size, uint32_t timeout);
+int32_t pipeSetTrigger(handle p, uint16_t level);
+int32_t subscribe(handle topic);
+int32_t unsubscribe(handle topic);
+int32_t publish(handle topic, const void *data, uint32_t size);
+int32_t topicTake(handle topic, const void **sample, uint32_t timeout);
+int32_t topicRelease(const void *sample);
+int32_t barrierWait(handle b);
+
+// A notify that would leave the value 0 fails with RTOS_ERR_INVALID, so a
+// 0 return from notifyWait always means the timeout expired
+int32_t notify(_fn fn, uint32_t bits, uint8_t action);
+uint32_t notifyWait(uint32_t clearMask, uint32_t timeout);
+
+void scanStacks(void);
+
+void *taskMalloc(uint32_t size);
+int32_t taskFree(void *p);
+
+int32_t futexWait(volatile uint32_t *addr, uint32_t expected, uint32_t timeout);
+int32_t futexWake(volatile uint32_t *addr, uint32_t count);
+
+void initWaitQueue(waitQueue *q);
+
+// Kernel entry for the slow paths, always traps
+int32_t svcLock(handle mutex);
+int32_t svcUnlock(handle mutex);
+int32_t svcWait(handle semaphore);
+int32_t svcPost(handle semaphore);
+uint32_t getCycles(void);
 
 void sysTickIsr(void);
 void svCallIsr(void);
+void reclaimKilledTasks(void);
 
 #endif
 
@@ -15,102 +15,357 @@
 #include <stdint.h>
 #include "tm4c123gh6pm.h"
 #include "mm.h"
+#include "psp_msp.h"
 
 //-----------------------------------------------------------------------------
 // Subroutines
 //-----------------------------------------------------------------------------
 
 extern uint8_t taskCurrent;
-static BlockInfo blockTable[MAX_BLOCKS];
+extern uint8_t __kernel_end;        // end of .data/.bss/.sysmem/.stack, see the .cmd file
 
-void *malloc_heap(int size_in_bytes, uint16_t pid)
+uint8_t *heapBase;
+uint32_t heapSize;
+
+// Bit i of freeMap is set while block i is free, bit i of endMap marks the
+// last block of an allocation so its length is found without a scan
+static uint32_t freeMap;
+static uint32_t endMap;
+static uint8_t blockOwner[MAX_BLOCKS];   // low byte of the pid, head blocks only
+
+// A slab is one block carved into objects of a single cache size, owned by
+// the pid that allocated its first object; its bookkeeping stays out of the
+// block so the owner cannot corrupt it
+typedef struct
+{
+    uint8_t cache;                  // cache index + 1, 0 when not a slab
+    uint8_t used;                   // objects handed out
+    uint32_t freeObjects[2];        // bit set while the object is free
+} slabInfo;
+
+static slabInfo slab[MAX_BLOCKS];
+static uint32_t partialSlabs[SLAB_CACHES];  // slabs of each cache with a free object
+
+#define ALL_BLOCKS  ((uint32_t)((1ULL << MAX_BLOCKS) - 1))
+
+// Bits of blocks whose address is a multiple of align
+static uint32_t alignedStarts(uint32_t align)
 {
-    int i, j;
-    if (size_in_bytes <= 0 || pid == 0)
+    uint32_t mask = 0;
+    uint32_t step = align / BLOCK_SIZE;
+    uint32_t i = (((uint32_t)HEAP_BASE + align - 1) & ~(align - 1)) - (uint32_t)HEAP_BASE;
+
+    if (align <= BLOCK_SIZE)
+        return ALL_BLOCKS;
+
+    for (i /= BLOCK_SIZE; i < MAX_BLOCKS; i += step)
+        mask |= 1U << i;
+    return mask;
+}
+
+// First fit run of free blocks whose start address is a multiple of align
+// Runs of n free blocks are found by and-ing freeMap with itself shifted,
+// doubling the run length each step, then the lowest start is picked by CTZ
+void *malloc_heap_aligned(int size_in_bytes, uint32_t align, uint16_t pid)
+{
+    if (size_in_bytes <= 0 || pid == 0 || align == 0 || (align & (align - 1)) != 0)
         return 0;
 
     uint32_t blocksNeeded = (size_in_bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (blocksNeeded > MAX_BLOCKS)
+        return 0;
 
-    for (i = 0; i < MAX_BLOCKS; i++)
+    uint32_t starts = freeMap;
+    uint32_t run = 1;
+    while (run < blocksNeeded && starts != 0)
     {
-        if (i + blocksNeeded > MAX_BLOCKS)
-            continue;
+        uint32_t step = run < blocksNeeded - run ? run : blocksNeeded - run;
+        starts &= starts >> step;
+        run += step;
+    }
+    starts &= alignedStarts(align);
+    if (starts == 0)
+        return 0;
 
-        bool free = true;
-        for (j = 0; j < blocksNeeded; j++)
-        {
-            if (blockTable[i + j].used)
-            {
-                free = false;
-                i += j; //skip past occupied blocks
-                break;
-            }
-        }
+    uint32_t i = countTrailingZeros(starts);
+    uint32_t last = i + blocksNeeded - 1;
 
-        if (!free)
-            continue;
+    freeMap &= ~(((2U << last) - 1) & ~((1U << i) - 1));
+    endMap |= 1U << last;
+    blockOwner[i] = (uint8_t)pid;
+    return (void *)(HEAP_BASE + (i * BLOCK_SIZE));
+}
+
+static uint32_t slabObjectSize(uint8_t cache)
+{
+    return SLAB_MIN_SIZE << cache;
+}
+
+// Objects are handed out lowest first from a slab of the caller that still
+// has room, a new slab is carved from a block only when none has
+static void *mallocSmall(uint8_t cache, uint16_t pid)
+{
+    uint32_t size = slabObjectSize(cache);
+    uint32_t candidates = partialSlabs[cache];
+    uint32_t index = MAX_BLOCKS;
+    uint32_t word, object;
 
-        for (j = 0; j < blocksNeeded; j++)
+    while (candidates != 0)
+    {
+        uint32_t i = countTrailingZeros(candidates);
+        if (blockOwner[i] == (uint8_t)pid)
         {
-            blockTable[i + j].used = true;
-            blockTable[i + j].pid = pid;
-            blockTable[i + j].length = 0;
+            index = i;
+            break;
         }
+        candidates &= candidates - 1;
+    }
 
-        blockTable[i].length = blocksNeeded;
-        return (void *)(HEAP_BASE + (i * BLOCK_SIZE));
+    if (index == MAX_BLOCKS)
+    {
+        uint8_t *block = (uint8_t *)malloc_heap_aligned(BLOCK_SIZE, BLOCK_SIZE, pid);
+        uint32_t objects = BLOCK_SIZE / size;
+        if (block == 0)
+            return 0;
+
+        index = (block - HEAP_BASE) / BLOCK_SIZE;
+        slab[index].cache = cache + 1;
+        slab[index].used = 0;
+        slab[index].freeObjects[0] = objects >= 32 ? 0xFFFFFFFF : (1U << objects) - 1;
+        slab[index].freeObjects[1] = objects >= 64 ? 0xFFFFFFFF : objects > 32 ? (1U << (objects - 32)) - 1 : 0;
+        partialSlabs[cache] |= 1U << index;
     }
 
-    printHex("malloc return:", (uint32_t)(HEAP_BASE + i*BLOCK_SIZE));
+    word = slab[index].freeObjects[0] != 0 ? 0 : 1;
+    object = countTrailingZeros(slab[index].freeObjects[word]);
+    slab[index].freeObjects[word] &= ~(1U << object);
+    slab[index].used++;
+    if ((slab[index].freeObjects[0] | slab[index].freeObjects[1]) == 0)
+        partialSlabs[cache] &= ~(1U << index);
+
+    return HEAP_BASE + index * BLOCK_SIZE + (word * 32 + object) * size;
+}
+
+// Smallest power of two, at least one block, that holds size_in_bytes
+uint32_t heapRegionSize(int size_in_bytes)
+{
+    uint32_t size = BLOCK_SIZE;
 
-    return 0;
+    while (size < (uint32_t)size_in_bytes && size < HEAP_SIZE)
+        size <<= 1;
+    return size;
+}
+
+// Buddy-style placement: a power of two sized, naturally aligned run that
+// one MPU region can describe exactly
+void *malloc_heap_region(int size_in_bytes, uint16_t pid)
+{
+    uint32_t size = heapRegionSize(size_in_bytes);
+
+    if (size_in_bytes <= 0 || size < (uint32_t)size_in_bytes)
+        return 0;
+    return malloc_heap_aligned(size, size, pid);
+}
+
+// Sizes up to SLAB_MAX_SIZE come from the slab caches, larger ones take
+// whole blocks
+void *malloc_heap(int size_in_bytes, uint16_t pid)
+{
+    uint8_t cache = 0;
+
+    if (size_in_bytes > 0 && size_in_bytes <= SLAB_MAX_SIZE && pid != 0)
+    {
+        while (slabObjectSize(cache) < (uint32_t)size_in_bytes)
+            cache++;
+        return mallocSmall(cache, pid);
+    }
+    return malloc_heap_aligned(size_in_bytes, BLOCK_SIZE, pid);
+}
+
+// An allocation starts at a used block whose predecessor is free or ends
+// another allocation
+static bool isHeadBlock(uint32_t index)
+{
+    if (freeMap & (1U << index))
+        return false;
+    return index == 0 || (freeMap & (1U << (index - 1))) || (endMap & (1U << (index - 1)));
+}
+
+static void freeBlocks(uint32_t index)
+{
+    uint32_t last = index + countTrailingZeros(endMap >> index);
+    freeMap |= ((2U << last) - 1) & ~((1U << index) - 1);
+    endMap &= ~(1U << last);
+}
+
+// The slab goes back to the block heap once its last object is freed
+static bool freeSmall(uint32_t index, uint32_t offset, uint16_t pid)
+{
+    uint8_t cache = slab[index].cache - 1;
+    uint32_t size = slabObjectSize(cache);
+    uint32_t object = offset / size;
+
+    if (offset % size != 0 || blockOwner[index] != (uint8_t)pid)
+        return false;
+    if (slab[index].freeObjects[object / 32] & (1U << (object % 32)))
+        return false;
+
+    slab[index].freeObjects[object / 32] |= 1U << (object % 32);
+    if (--slab[index].used == 0)
+    {
+        slab[index].cache = 0;
+        partialSlabs[cache] &= ~(1U << index);
+        freeBlocks(index);
+    }
+    else
+        partialSlabs[cache] |= 1U << index;
+    return true;
 }
 
 bool free_heap(void *p, uint16_t pid)
 {
-    uint32_t i;
     if (p == 0 || pid == 0)
         return false;
 
     uintptr_t addr = (uintptr_t)p;
     uintptr_t base = (uintptr_t)HEAP_BASE;
 
-    //Must be inside heap and be block aligned
+    //Must be inside heap, and block aligned unless it is a slab object
     if (addr < base || addr >= base + HEAP_SIZE)
         return false;
-    if ((addr - base) % BLOCK_SIZE != 0)
-        return false;
 
     uint32_t index = (addr - base) / BLOCK_SIZE;
-    BlockInfo *blk = &blockTable[index];
+    uint32_t offset = (addr - base) % BLOCK_SIZE;
 
-    //Must be a valid head block
-    if (!blk->used || blk->pid != pid || blk->length == 0)
+    if (slab[index].cache != 0)
+        return freeSmall(index, offset, pid);
+    if (offset != 0)
         return false;
 
-    uint32_t count = blk->length;
-    if (index + count > MAX_BLOCKS)
+    //Must be a valid head block
+    if (!isHeadBlock(index) || blockOwner[index] != (uint8_t)pid)
         return false;
 
-    for (i = 0; i < count; i++)
+    freeBlocks(index);
+    return true;
+}
+
+void getSlabStats(uint8_t cache, slabStats *out)
+{
+    uint32_t i;
+
+    out->objectSize = slabObjectSize(cache);
+    out->slabs = 0;
+    out->used = 0;
+    for (i = 0; i < MAX_BLOCKS; i++)
     {
-        blockTable[index + i].used = false;
-        blockTable[index + i].pid = 0;
-        blockTable[index + i].length = 0;
+        if (slab[i].cache == cache + 1)
+        {
+            out->slabs++;
+            out->used += slab[i].used;
+        }
     }
+    out->capacity = out->slabs * (BLOCK_SIZE / out->objectSize);
+}
+
+// Takes the single block at p if it is free, used to grow a stack downwards
+bool claim_heap_block(void *p, uint16_t pid)
+{
+    uint32_t index = ((uint8_t *)p - HEAP_BASE) / BLOCK_SIZE;
+
+    if ((uint8_t *)p < HEAP_BASE || index >= MAX_BLOCKS || (freeMap & (1U << index)) == 0)
+        return false;
 
+    freeMap &= ~(1U << index);
+    endMap |= 1U << index;
+    blockOwner[index] = (uint8_t)pid;
     return true;
 }
 
+// Blocks of every allocation owned by pid, slabs included
+uint32_t heapBlocksOwned(uint16_t pid)
+{
+    uint32_t owned = 0;
+    uint32_t i = 0;
+
+    while (i < MAX_BLOCKS)
+    {
+        if (!isHeadBlock(i))
+        {
+            i++;
+            continue;
+        }
+        uint32_t last = i + countTrailingZeros(endMap >> i);
+        if (blockOwner[i] == (uint8_t)pid)
+            owned |= ((2U << last) - 1) & ~((1U << i) - 1);
+        i = last + 1;
+    }
+    return owned;
+}
+
+// Frees every allocation and slab of pid at once except the allocation
+// starting at keep, returns the bytes freed
+uint32_t free_heap_pid(uint16_t pid, void *keep)
+{
+    uint32_t owned = heapBlocksOwned(pid);
+    uint32_t bytes = 0;
+    uint32_t i;
+
+    if (keep != 0)
+    {
+        i = ((uint8_t *)keep - HEAP_BASE) / BLOCK_SIZE;
+        if (i < MAX_BLOCKS && isHeadBlock(i))
+        {
+            uint32_t last = i + countTrailingZeros(endMap >> i);
+            owned &= ~(((2U << last) - 1) & ~((1U << i) - 1));
+        }
+    }
+
+    for (i = 0; i < MAX_BLOCKS; i++)
+    {
+        if (owned & (1U << i))
+        {
+            if (slab[i].cache != 0)
+                partialSlabs[slab[i].cache - 1] &= ~(1U << i);
+            slab[i].cache = 0;
+            bytes += BLOCK_SIZE;
+        }
+    }
+    freeMap |= owned;
+    endMap &= ~owned;
+    return bytes;
+}
+
+uint32_t freeBlockCount(void)
+{
+    uint32_t count = 0;
+    uint32_t m = freeMap;
+
+    while (m != 0)
+    {
+        m &= m - 1;
+        count++;
+    }
+    return count;
+}
+
 void initMemoryManager(void)
 {
     uint32_t i;
+
+    // First whole block after the kernel up to the end of SRAM
+    heapBase = (uint8_t *)(((uint32_t)&__kernel_end + BLOCK_SIZE - 1) & ~(BLOCK_SIZE - 1));
+    heapSize = SRAM_BASE + SRAM_SIZE - (uint32_t)heapBase;
+
+    freeMap = ALL_BLOCKS >> (MAX_BLOCKS - HEAP_BLOCKS);
+    endMap = 0;
     for (i = 0; i < MAX_BLOCKS; i++)
     {
-        blockTable[i].used = false;
-        blockTable[i].pid = 0;
-        blockTable[i].length = 0;
+        blockOwner[i] = 0;
+        slab[i].cache = 0;
     }
+    for (i = 0; i < SLAB_CACHES; i++)
+        partialSlabs[i] = 0;
 }
 
 #define REGION_ENABLE (1U)
@@ -126,39 +381,21 @@ void disableMpu(void)
     NVIC_MPU_CTRL_R = 0;
 }
 
+// Regions 0-3 split SRAM into quarters so each SRD bit is one heap block,
+// blocks below HEAP_BASE are never in a task's windows
 void setupSramAccess(void)
 {
-    // region 0 0x20000000 - 0x20001FFF
-    NVIC_MPU_NUMBER_R = 0;
-    NVIC_MPU_BASE_R = 0x20000000;
-    NVIC_MPU_ATTR_R = REGION_ENABLE
-                    | (12 << 1)
-                    | (0b11 << 24)
-                    | (0xFF << 8);
-
-    // region 1 0x20002000 - 0x20003FFF
-    NVIC_MPU_NUMBER_R = 1;
-    NVIC_MPU_BASE_R = 0x20002000;
-    NVIC_MPU_ATTR_R = REGION_ENABLE
-                    | (12 << 1)
-                    | (0b11 << 24)
-                    | (0xFF << 8);
+    uint32_t region;
 
-    // region 2 0x20004000 - 0x20005FFF
-    NVIC_MPU_NUMBER_R = 2;
-    NVIC_MPU_BASE_R = 0x20004000;
-    NVIC_MPU_ATTR_R = REGION_ENABLE
-                    | (12 << 1)
-                    | (0b11 << 24)
-                    | (0xFF << 8);
-
-    // region 3 0x20006000 - 0x20007FFF
-    NVIC_MPU_NUMBER_R = 3;
-    NVIC_MPU_BASE_R = 0x20006000;
-    NVIC_MPU_ATTR_R = REGION_ENABLE
-                    | (12 << 1)
-                    | (0b11 << 24)
-                    | (0xFF << 8);
+    for (region = 0; region < 4; region++)
+    {
+        NVIC_MPU_NUMBER_R = region;
+        NVIC_MPU_BASE_R = SRAM_BASE + region * (SRAM_SIZE / 4);
+        NVIC_MPU_ATTR_R = REGION_ENABLE
+                        | ((countTrailingZeros(SRAM_SIZE / 4) - 1) << 1)
+                        | (0b11 << 24)
+                        | (0xFF << 8);
+    }
 }
 
 // Flash and Peripheral Regions
@@ -181,6 +418,48 @@ void allowPeripheralAccess(void)
                     | XN_ENABLE;
 }
 
+// Region 4 maps the running task's stack, a region returned by
+// malloc_heap_region, size 0 disables it
+// With guard set the lowest subregion is disabled; the block is in no SRD
+// window, so the first push below it faults
+void setupStackRegion(uint32_t baseAddress, uint32_t size, bool guard)
+{
+    NVIC_MPU_NUMBER_R = 4;
+    if (size == 0)
+    {
+        NVIC_MPU_ATTR_R = 0;
+        return;
+    }
+    NVIC_MPU_BASE_R = baseAddress;
+    NVIC_MPU_ATTR_R = REGION_ENABLE
+                    | ((countTrailingZeros(size) - 1) << 1)
+                    | (0b11 << 24)
+                    | ((guard ? 0x01 : 0x00) << 8)
+                    | XN_ENABLE;
+}
+
+// Region 7 overlays a 2 KiB block of the heap read-only for unprivileged
+// code, each 256 B subregion is enabled only while the task holds it
+void setupTopicAccess(uint32_t baseAddress)
+{
+    NVIC_MPU_NUMBER_R = 7;
+    NVIC_MPU_BASE_R = baseAddress;
+    NVIC_MPU_ATTR_R = REGION_ENABLE
+                    | (10 << 1)
+                    | (0b10 << 24)
+                    | (0xFF << 8)
+                    | XN_ENABLE;
+}
+
+void applyTopicAccessMask(uint8_t readable)
+{
+    NVIC_MPU_NUMBER_R = 7;
+    volatile uint32_t attr = NVIC_MPU_ATTR_R;
+    attr &= ~(0xFF << 8);
+    attr |= (uint32_t)(uint8_t)~readable << 8;
+    NVIC_MPU_ATTR_R = attr;
+}
+
 // Initialization wrapper
 void initMemoryProtection(void)
 {
@@ -211,7 +490,7 @@ void applySramAccessMask(uint32_t srdBitMask)
 
 void addSramAccessWindow(uint32_t *srdMask, uint32_t baseAddress, uint32_t size)
 {
-    uint32_t offset = baseAddress - 0x20000000;
+    uint32_t offset = baseAddress - SRAM_BASE;
     uint32_t index = offset / 1024;
 
     while (size > 0 && index < 32)
@@ -222,11 +501,23 @@ void addSramAccessWindow(uint32_t *srdMask, uint32_t baseAddress, uint32_t size)
     }
 }
 
-uint32_t createSramAccessMaskForStack(uint32_t base, uint32_t size)
+// True if every 1 KiB subregion touched by the range is enabled in the mask
+bool isSramAccessAllowed(uint32_t srdMask, uint32_t baseAddress, uint32_t size)
 {
-    uint32_t mask = createNoSramAccessMask();
-    addSramAccessWindow(&mask, base, size + 1024);
-    return mask;
+    if (size == 0 || baseAddress < SRAM_BASE || baseAddress + size > SRAM_BASE + SRAM_SIZE ||
+        baseAddress + size < baseAddress)
+        return false;
+
+    uint32_t first = (baseAddress - SRAM_BASE) / 1024;
+    uint32_t last  = (baseAddress + size - 1 - SRAM_BASE) / 1024;
+
+    while (first <= last)
+    {
+        if (srdMask & (1U << first))
+            return false;
+        first++;
+    }
+    return true;
 }
 
 
@@ -17,20 +17,34 @@
 //-----------------------------------------------------------------------------
 // Memory layout
 //-----------------------------------------------------------------------------
-#define HEAP_BASE   ((uint8_t *)0x20001000)
-#define HEAP_SIZE   (28 * 1024)
-#define BLOCK_SIZE  1024
-#define MAX_BLOCKS  (HEAP_SIZE / BLOCK_SIZE)
+#define SRAM_BASE   0x20000000
+#define SRAM_SIZE   (32 * 1024)
+#define BLOCK_SIZE  1024            // one SRD subregion of regions 0-3
+#define MAX_BLOCKS  (SRAM_SIZE / BLOCK_SIZE)
+
+// The heap is whatever SRAM the linker leaves after the kernel sections,
+// set by initMemoryManager from __kernel_end
+extern uint8_t *heapBase;
+extern uint32_t heapSize;
+#define HEAP_BASE   heapBase
+#define HEAP_SIZE   heapSize
+#define HEAP_BLOCKS (HEAP_SIZE / BLOCK_SIZE)
+
+// Slab caches of 16, 32, 64, 128 and 256 byte objects
+#define SLAB_CACHES   5
+#define SLAB_MIN_SIZE 16
+#define SLAB_MAX_SIZE (SLAB_MIN_SIZE << (SLAB_CACHES - 1))
 
 //-----------------------------------------------------------------------------
 // Data structures
 //-----------------------------------------------------------------------------
 typedef struct
 {
-    bool used;
-    uint16_t pid;
-    uint16_t length;
-} BlockInfo;
+    uint16_t objectSize;
+    uint8_t slabs;
+    uint16_t used;
+    uint16_t capacity;
+} slabStats;
 
 //-----------------------------------------------------------------------------
 // Function prototypes
@@ -39,7 +53,15 @@ typedef struct
 // Heap manager
 extern bool free_heap(void *p, uint16_t pid);
 extern void *malloc_heap(int size_in_bytes, uint16_t pid);
+extern void *malloc_heap_aligned(int size_in_bytes, uint32_t align, uint16_t pid);
+extern void *malloc_heap_region(int size_in_bytes, uint16_t pid);
+extern uint32_t free_heap_pid(uint16_t pid, void *keep);
+extern bool claim_heap_block(void *p, uint16_t pid);
+uint32_t heapRegionSize(int size_in_bytes);
 void   initMemoryManager(void);
+void   getSlabStats(uint8_t cache, slabStats *out);
+uint32_t freeBlockCount(void);
+uint32_t heapBlocksOwned(uint16_t pid);
 
 // MPU initialization
 void initMpu(void);
@@ -48,12 +70,15 @@ void disableMpu(void);
 void setupSramAccess(void);
 void allowFlashAccess(void);
 void allowPeripheralAccess(void);
+void setupStackRegion(uint32_t baseAddress, uint32_t size, bool guard);
+void setupTopicAccess(uint32_t baseAddress);
+void applyTopicAccessMask(uint8_t readable);
 
 // Heap access control
 uint32_t createNoSramAccessMask(void);
 void applySramAccessMask(uint32_t srdMask);
 void addSramAccessWindow(uint32_t *srdMask, uint32_t baseAddress, uint32_t size);
-uint32_t createSramAccessMaskForStack(uint32_t base, uint32_t size);
+bool isSramAccessAllowed(uint32_t srdMask, uint32_t baseAddress, uint32_t size);
 
 
 #endif
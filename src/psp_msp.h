@@ -2,6 +2,7 @@
 #define PSP_MSP_H_
 
 #include <stdint.h>
+#include <stdbool.h>
 
 uint32_t getPsp(void);
 uint32_t getMsp(void);
@@ -9,10 +10,15 @@ void     setPsp(uint32_t sp);
 void     setAsp(void);
 void     switchToPriv(void);
 void     switchToUnpriv(void);
+uint32_t getBasepri(void);
+void     setBasepri(uint32_t basepri);
+void     setBasepriMax(uint32_t basepri);
+
+bool     casWord(volatile uint32_t *addr, uint32_t expected, uint32_t desired);
+uint32_t countTrailingZeros(uint32_t value);
 
 void     sleep(uint32_t tick);
-void     wait(int8_t semaphore);
-void     post(int8_t semaphore);
+uint32_t getControl(void);
 
 void     PendSVISR(void);
 
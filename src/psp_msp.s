@@ -3,10 +3,16 @@
     .def setPsp
     .def setAsp
     .def switchToUnpriv
+    .def getBasepri
+    .def setBasepri
+    .def setBasepriMax
     .def PendSVISR
     .def sleep
-    .def wait
-    .def post
+    .def svcWait
+    .def svcPost
+    .def casWord
+    .def getControl
+    .def countTrailingZeros
     .def pidof
     .def killThread
     .def restartThread
@@ -39,11 +45,11 @@ sleep:
     SVC #1
     BX  LR
 
-wait:
+svcWait:
 	SVC #4
 	BX  LR
 
-post:
+svcPost:
 	SVC #5
 	BX  LR
 
@@ -70,6 +76,47 @@ switchToUnpriv:
     ISB
     BX LR
 
+; compare and swap with LDREX/STREX, returns 1 if desired was stored
+; an exception between the pair clears the monitor and the store retries
+casWord:
+    LDREX R3, [R0]
+    CMP   R3, R1
+    BNE   casFail
+    STREX R3, R2, [R0]
+    CMP   R3, #0
+    BNE   casWord
+    MOV   R0, #1
+    BX    LR
+casFail:
+    CLREX
+    MOV   R0, #0
+    BX    LR
+
+getControl:
+    MRS R0, CONTROL
+    BX  LR
+
+; 32 when no bit is set
+countTrailingZeros:
+    RBIT R0, R0
+    CLZ  R0, R0
+    BX   LR
+
+getBasepri:
+    MRS R0, BASEPRI
+    BX  LR
+
+setBasepri:
+    MSR BASEPRI, R0
+    ISB
+    BX  LR
+
+; only raises the mask, never lowers it
+setBasepriMax:
+    MSR BASEPRI_MAX, R0
+    ISB
+    BX  LR
+
 PendSVISR:
     MRS   r0, psp
     STMDB r0!, {r4-r11}      ; push R4R11 to thread stack
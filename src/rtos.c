@@ -62,11 +62,9 @@ int main(void)
     // Setup UART0 baud rate
     setUart0BaudRate(115200, 40e6);
 
-    // Initialize mutexes and semaphores
-    initMutex(resource);
-    initSemaphore(keyPressed, 1);
-    initSemaphore(keyReleased, 0);
-    initSemaphore(flashReq, 5);
+    // Create mutexes and semaphores, tasks find them by name
+    ok &= createMutex("resource") != INVALID_HANDLE;
+    ok &= createSemaphore(5, "flashReq") != INVALID_HANDLE;
 
     // Add required idle process at lowest priority
     ok &= createThread(idle,    "Idle",    7, 512);
@@ -100,9 +98,14 @@ int main(void)
             printHex("  state:", tcb[i].state);
         }
     }
+    printMemoryMap();
+
     // Start up RTOS
     if (ok)
         startRtos(); // never returns
     else
+    {
+        putsUart0("Task creation failed, the demo set does not fit in the heap\n");
         while(true);
+    }
 }
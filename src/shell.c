@@ -31,6 +31,8 @@
 #define MAX_CHARS 80
 #define MAX_FIELDS 5
 
+#define BENCH_LOOPS 1000
+
 // UART Input / Parsing
 void getsUart0(USER_DATA* data)
 {
@@ -152,12 +154,22 @@ __attribute__((naked)) void ps(void)
     __asm(" BX  LR");
 }
 
-__attribute__((naked)) void ipcs(void)
+__attribute__((naked)) void ipcs(uint8_t view)
 {
+    (void)view;
     __asm(" SVC #12");
     __asm(" BX  LR");
 }
 
+static void printReclaimed(uint32_t bytes)
+{
+    char str[12];
+    itoa(bytes, str, 10);
+    putsUart0("reclaimed ");
+    putsUart0(str);
+    putsUart0(" bytes\n");
+}
+
 void kill(uint32_t pid)
 {
     if (pid == 0)
@@ -166,7 +178,7 @@ void kill(uint32_t pid)
         return;
     }
 
-    killThread((_fn)pid);
+    printReclaimed(killThread((_fn)pid));
 }
 
 void pkill(const char name[])
@@ -180,7 +192,7 @@ void pkill(const char name[])
         return;
     }
 
-    killThread((_fn)pid);
+    printReclaimed(killThread((_fn)pid));
 }
 
 __attribute__((naked)) void pi(bool on)
@@ -197,6 +209,38 @@ __attribute__((naked)) void preempt(bool on)
     __asm(" BX  LR");
 }
 
+__attribute__((naked)) void deadlock(uint8_t policy)
+{
+    (void)policy;
+    __asm(" SVC #47");
+    __asm(" BX  LR");
+}
+
+__attribute__((naked)) void lockstats(bool on)
+{
+    (void)on;
+    __asm(" SVC #48");
+    __asm(" BX  LR");
+}
+
+__attribute__((naked)) void stack(void)
+{
+    __asm(" SVC #54");
+    __asm(" BX  LR");
+}
+
+__attribute__((naked)) void heap(void)
+{
+    __asm(" SVC #50");
+    __asm(" BX  LR");
+}
+
+__attribute__((naked)) void heapbench(void)
+{
+    __asm(" SVC #49");
+    __asm(" BX  LR");
+}
+
 __attribute__((naked)) void sched(bool prio_on)
 {
     (void)prio_on;
@@ -218,6 +262,68 @@ void run(const char name[])
     restartThread((_fn)pid);
 }
 
+static void printBench(const char label[], uint32_t cycles)
+{
+    char str[12];
+    putsUart0((char*)label);
+    itoa(cycles / BENCH_LOOPS, str, 10);
+    putsUart0(str);
+    putsUart0(" cycles\n");
+}
+
+// Compares the LDREX/STREX fast paths with a forced SVC round trip
+// The objects are private to this command so stay uncontended
+void bench(void)
+{
+    uint32_t start;
+    uint16_t i;
+    handle benchMutex = createMutex("bench");
+    handle benchSemaphore = createSemaphore(0, "bench");
+
+    if (benchMutex == INVALID_HANDLE || benchSemaphore == INVALID_HANDLE)
+    {
+        putsUart0("no free objects\n");
+        deleteObject(benchMutex);
+        deleteObject(benchSemaphore);
+        return;
+    }
+
+    start = getCycles();
+    for (i = 0; i < BENCH_LOOPS; i++)
+    {
+        lock(benchMutex);
+        unlock(benchMutex);
+    }
+    printBench("lock/unlock fast: ", getCycles() - start);
+
+    start = getCycles();
+    for (i = 0; i < BENCH_LOOPS; i++)
+    {
+        svcLock(benchMutex);
+        svcUnlock(benchMutex);
+    }
+    printBench("lock/unlock svc:  ", getCycles() - start);
+
+    start = getCycles();
+    for (i = 0; i < BENCH_LOOPS; i++)
+    {
+        post(benchSemaphore);
+        wait(benchSemaphore);
+    }
+    printBench("post/wait fast:   ", getCycles() - start);
+
+    start = getCycles();
+    for (i = 0; i < BENCH_LOOPS; i++)
+    {
+        svcPost(benchSemaphore);
+        svcWait(benchSemaphore);
+    }
+    printBench("post/wait svc:    ", getCycles() - start);
+
+    deleteObject(benchMutex);
+    deleteObject(benchSemaphore);
+}
+
 // REQUIRED: add processing for the shell commands through the UART here
 void shell(void)
 {
@@ -233,7 +339,15 @@ void shell(void)
         else if (isCommand(&data, "ps", 0))
             ps();
         else if (isCommand(&data, "ipcs", 0))
-            ipcs();
+        {
+            char* arg = getFieldString(&data, 1);
+            if (arg != 0 && arg[0] == '-' && (arg[1] == 'd' || arg[1] == 'D'))
+                ipcs(IPCS_WAIT_FOR);
+            else if (arg != 0 && (arg[0] == 'R' || arg[0] == 'r'))
+                ipcs(IPCS_RESET);
+            else
+                ipcs(IPCS_OBJECTS);
+        }
         else if (isCommand(&data, "kill", 1))
             kill(getFieldInteger(&data, 1));
         else if (isCommand(&data, "pkill", 1))
@@ -256,6 +370,22 @@ void shell(void)
                 else if (arg[1] == 'F' || arg[1] == 'f') preempt(false);
             }
         }
+        else if (isCommand(&data, "lockstats", 1))
+        {
+            char* arg = getFieldString(&data, 1);
+            if (arg[0] == 'O' || arg[0] == 'o')
+            {
+                if (arg[1] == 'N' || arg[1] == 'n') lockstats(true);
+                else if (arg[1] == 'F' || arg[1] == 'f') lockstats(false);
+            }
+        }
+        else if (isCommand(&data, "deadlock", 1))
+        {
+            char* arg = getFieldString(&data, 1);
+            if (arg[0] == 'O' || arg[0] == 'o') deadlock(DEADLOCK_OFF);
+            else if (arg[0] == 'R' || arg[0] == 'r') deadlock(DEADLOCK_REPORT);
+            else if (arg[0] == 'A' || arg[0] == 'a') deadlock(DEADLOCK_ABORT);
+        }
         else if (isCommand(&data, "sched", 1))
         {
             char* arg = getFieldString(&data, 1);
@@ -280,5 +410,13 @@ void shell(void)
         {
             run(getFieldString(&data, 1));
         }
+        else if (isCommand(&data, "bench", 0))
+            bench();
+        else if (isCommand(&data, "heapbench", 0))
+            heapbench();
+        else if (isCommand(&data, "heap", 0))
+            heap();
+        else if (isCommand(&data, "stack", 0))
+            stack();
     }
 }
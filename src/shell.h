@@ -40,13 +40,19 @@ void itoa(int num, char* str, int base);
 
 void reboot(void);
 void ps(void);
-void ipcs(void);
+void ipcs(uint8_t view);
 void kill(uint32_t pid);
 void pkill(const char name[]);
 void pi(bool on);
 void preempt(bool on);
 void sched(bool prio_on);
+void deadlock(uint8_t policy);
+void lockstats(bool on);
 int pidof(const char name[]);
 void run(const char name[]);
+void bench(void);
+void heap(void);
+void stack(void);
+void heapbench(void);
 
 #endif // SHELL_H_
@@ -115,6 +115,7 @@ void idle(void)
         setPinValue(ORANGE_LED, 1);
         waitMicrosecond(1000);
         setPinValue(ORANGE_LED, 0);
+        scanStacks();
         yield();
     }
 }
@@ -131,6 +132,7 @@ void flash4Hz(void)
 
 void oneshot(void)
 {
+    handle flashReq = findObject("flashReq");
     while(true)
     {
         wait(flashReq);
@@ -151,6 +153,7 @@ void partOfLengthyFn(void)
 void lengthyFn(void)
 {
     uint16_t i;
+    handle resource = findObject("resource");
     while(true)
     {
         lock(resource);
@@ -166,16 +169,18 @@ void lengthyFn(void)
 void readKeys(void)
 {
     uint8_t buttons;
+    handle flashReq = findObject("flashReq");
     while(true)
     {
-        wait(keyReleased);
+        // key released
+        notifyWait(0xFFFFFFFF, WAIT_FOREVER);
         buttons = 0;
         while (buttons == 0)
         {
             buttons = readPbs();
             yield();
         }
-        post(keyPressed);
+        notify(debounce, 1, NOTIFY_SET_BITS);
         if ((buttons & 1) != 0)
         {
             setPinValue(YELLOW_LED, !getPinValue(YELLOW_LED));
@@ -207,7 +212,6 @@ void debounce(void)
     uint8_t count;
     while(true)
     {
-        wait(keyPressed);
         count = 10;
         while (count != 0)
         {
@@ -217,7 +221,9 @@ void debounce(void)
             else
                 count = 10;
         }
-        post(keyReleased);
+        notify(readKeys, 1, NOTIFY_SET_BITS);
+        // key pressed
+        notifyWait(0xFFFFFFFF, WAIT_FOREVER);
     }
 }
 
@@ -247,6 +253,7 @@ void errant(void)
 
 void important(void)
 {
+    handle resource = findObject("resource");
     while(true)
     {
         lock(resource);
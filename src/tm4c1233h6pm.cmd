@@ -36,10 +36,15 @@ SECTIONS
     .init_array : > FLASH
 
     .vtable :   > 0x20000000
-    .data   :   > SRAM
-    .bss    :   > SRAM
-    .sysmem :   > SRAM
-    .stack  :   > SRAM
+
+    /* Kept together so the RTOS heap can start at __kernel_end             */
+    GROUP
+    {
+        .data
+        .bss
+        .sysmem
+        .stack
+    } > SRAM, RUN_END(__kernel_end)
 }
 
 __STACK_TOP = __stack + 512;